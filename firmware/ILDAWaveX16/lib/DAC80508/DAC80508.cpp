@@ -57,8 +57,9 @@ void DAC80508::dac_write(uint8_t channel, uint16_t data) {
   // spi_device_get_trans_result(spi, &rtrans, portMAX_DELAY);
 }
 
+// Intensity only goes out when it changes, most sources never set it
 void DAC80508::dac_write_point(Point p) { 
-  uint8_t txbuf[6][3];
+  uint8_t txbuf[7][3];
   txbuf[0][0] = REG_DACx + DAC_CH_X;
   txbuf[0][1] = (p.x >> 8) & 0xFF;
   txbuf[0][2] = p.x & 0xFF;
@@ -79,12 +80,20 @@ void DAC80508::dac_write_point(Point p) {
   txbuf[4][1] = (p.b >> 8) & 0xFF;
   txbuf[4][2] = p.b & 0xFF;
 
-  txbuf[5][0] = REG_TRIGGER;
-  txbuf[5][1] = 0x00;
-  txbuf[5][2] = 0x10;
+  uint8_t n = 5;
+  if (p.i != lastIntensity) {
+    txbuf[n][0] = REG_DACx + DAC_CH_I;
+    txbuf[n][1] = (p.i >> 8) & 0xFF;
+    txbuf[n++][2] = p.i & 0xFF;
+    lastIntensity = p.i;
+  }
+
+  txbuf[n][0] = REG_TRIGGER;
+  txbuf[n][1] = 0x00;
+  txbuf[n++][2] = 0x10;
 
-  spi_transaction_t t[6] = {};
-  for (int i = 0; i < 6; i++) {
+  spi_transaction_t t[7] = {};
+  for (int i = 0; i < n; i++) {
       t[i].length = 24;
       t[i].tx_buffer = txbuf[i];
       spi_device_queue_trans(spi, &t[i], portMAX_DELAY);
@@ -37,6 +37,7 @@ class DAC80508 {
     void dac_sync( );
   private:
     uint8_t cs_pin = 0;
+    uint32_t lastIntensity = 0x10000; // DAC_CH_I as last written, out of range until the first point
     spi_device_handle_t spi;
 };
 
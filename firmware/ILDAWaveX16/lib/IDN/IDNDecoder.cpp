@@ -0,0 +1,133 @@
+#include "IDNDecoder.h"
+
+static const IDNSampleField layoutXY16RGBI8[] = { {IDN_FIELD_X, 0, 2}, {IDN_FIELD_Y, 2, 2}, {IDN_FIELD_R, 4, 1}, {IDN_FIELD_G, 5, 1}, {IDN_FIELD_B, 6, 1}, {IDN_FIELD_I, 7, 1} };
+static const IDNSampleField layoutXY16RGB8[] = { {IDN_FIELD_X, 0, 2}, {IDN_FIELD_Y, 2, 2}, {IDN_FIELD_R, 4, 1}, {IDN_FIELD_G, 5, 1}, {IDN_FIELD_B, 6, 1} };
+static const IDNSampleField layoutXY16RGB16[] = { {IDN_FIELD_X, 0, 2}, {IDN_FIELD_Y, 2, 2}, {IDN_FIELD_R, 4, 2}, {IDN_FIELD_G, 6, 2}, {IDN_FIELD_B, 8, 2} };
+static const IDNSampleField layoutXY16RGBI16[] = { {IDN_FIELD_X, 0, 2}, {IDN_FIELD_Y, 2, 2}, {IDN_FIELD_R, 4, 2}, {IDN_FIELD_G, 6, 2}, {IDN_FIELD_B, 8, 2}, {IDN_FIELD_I, 10, 2} };
+
+static bool matches(const IDNSampleField* a, uint8_t count, const IDNSampleField* b, uint8_t bCount) {
+  if (count != bCount) return false;
+  for (uint8_t i = 0; i < count; i++) {
+    if (a[i].target != b[i].target || a[i].offset != b[i].offset || a[i].width != b[i].width) return false;
+  }
+  return true;
+}
+
+// Default layout, matches what senders without a configuration header have always sent
+void IDNChannelConfig::reset() {
+  flags = 0;
+  serviceID = 0;
+  serviceMode = IDNVAL_SMOD_LPGRF_CONTINUOUS;
+  sampleSize = 8;
+  layout = IDN_LAYOUT_XY16_RGBI8;
+  fieldCount = sizeof(layoutXY16RGBI8) / sizeof(IDNSampleField);
+  memcpy(fields, layoutXY16RGBI8, sizeof(layoutXY16RGBI8));
+}
+
+// tags: wordCount * 2 network order tags following the configuration header
+uint8_t IDNChannelConfig::parse(const IDNHDR_CHANNEL_CONFIG* cfg, const uint16_t* tags) {
+  IDNSampleField parsed[IDN_MAX_FIELDS];
+  uint8_t count = 0;
+  uint16_t offset = 0;
+
+  for (uint16_t t = 0; t < cfg->wordCount * 2; t++) {
+    uint16_t tag = ntohs(tags[t]);
+    if (tag == IDNTAG_VOID) continue;
+
+    if (tag == IDNTAG_PRECISION) {
+      if (count == 0) return 1;
+      parsed[count - 1].width++;
+      offset++;
+      continue;
+    }
+
+    if (count >= IDN_MAX_FIELDS) return 1;
+    IDNSampleField& f = parsed[count++];
+    f.offset = offset++;
+    f.width = 1;
+    f.target = IDN_FIELD_SKIP;
+
+    if (tag == IDNTAG_X) f.target = IDN_FIELD_X;
+    else if (tag == IDNTAG_Y) f.target = IDN_FIELD_Y;
+    else if (tag == IDNTAG_INTENSITY) f.target = IDN_FIELD_I;
+    else if ((tag & IDNMSK_COLOR) == IDNTAG_COLOR) {
+      uint16_t nm = tag & IDNMSK_COLOR_WAVELENGTH;
+      f.target = nm < 500 ? IDN_FIELD_B : (nm < 600 ? IDN_FIELD_G : IDN_FIELD_R);
+    }
+
+    // Only the first field of a kind drives a channel, extra wavelengths are skipped
+    for (uint8_t i = 0; i + 1 < count; i++) {
+      if (parsed[i].target == f.target) { f.target = IDN_FIELD_SKIP; break; }
+    }
+  }
+  if (offset == 0 || offset > IDN_MAX_SAMPLE_SIZE) return 1;
+
+  flags = cfg->flags;
+  serviceID = cfg->serviceID;
+  serviceMode = cfg->serviceMode;
+  sampleSize = offset;
+  fieldCount = count;
+  memcpy(fields, parsed, count * sizeof(IDNSampleField));
+
+  if (matches(fields, count, layoutXY16RGBI8, 6)) layout = IDN_LAYOUT_XY16_RGBI8;
+  else if (matches(fields, count, layoutXY16RGB8, 5)) layout = IDN_LAYOUT_XY16_RGB8;
+  else if (matches(fields, count, layoutXY16RGB16, 5)) layout = IDN_LAYOUT_XY16_RGB16;
+  else if (matches(fields, count, layoutXY16RGBI16, 6)) layout = IDN_LAYOUT_XY16_RGBI16;
+  else layout = IDN_LAYOUT_GENERIC;
+  return 0;
+}
+
+// Fixed layouts: 16b big endian X/Y followed by R, G, B and optionally I of CB octets each
+template <uint8_t CB, bool I>
+static void decodeFixed(const uint8_t* d, uint16_t samples, Point* out) {
+  const uint8_t stride = 4 + (I ? 4 : 3) * CB;
+  for (uint16_t a = 0; a < samples; a++, d += stride) {
+    Point& p = out[a];
+    p.x = (int16_t)((d[0] << 8) | d[1]) + 0x8000;
+    p.y = -(int16_t)((d[2] << 8) | d[3]) + 0x8000;
+    if (CB == 1) {
+      p.r = d[4] * 257;
+      p.g = d[5] * 257;
+      p.b = d[6] * 257;
+      p.i = I ? d[7] * 257 : 0;
+    }
+    else {
+      p.r = (d[4] << 8) | d[5];
+      p.g = (d[6] << 8) | d[7];
+      p.b = (d[8] << 8) | d[9];
+      p.i = I ? (d[10] << 8) | d[11] : 0;
+    }
+  }
+}
+
+void IDNChannelConfig::decodeGeneric(const uint8_t* d, uint16_t samples, Point* out) const {
+  for (uint16_t a = 0; a < samples; a++, d += sampleSize) {
+    Point& p = out[a];
+    p = { 0, 0, 0, 0, 0, 0 };
+    for (uint8_t f = 0; f < fieldCount; f++) {
+      const IDNSampleField& field = fields[f];
+      const uint8_t* v = d + field.offset;
+      uint16_t value = field.width == 1 ? v[0] * 257 : (v[0] << 8) | v[1]; // extra precision octets are dropped
+      switch (field.target) {
+        case IDN_FIELD_X: p.x = (field.width == 1 ? (int16_t)(v[0] << 8) : (int16_t)value) + 0x8000; break;
+        case IDN_FIELD_Y: p.y = -(field.width == 1 ? (int16_t)(v[0] << 8) : (int16_t)value) + 0x8000; break;
+        case IDN_FIELD_R: p.r = value; break;
+        case IDN_FIELD_G: p.g = value; break;
+        case IDN_FIELD_B: p.b = value; break;
+        case IDN_FIELD_I: p.i = value; break;
+        default: break;
+      }
+    }
+  }
+}
+
+uint16_t IDNChannelConfig::decode(const uint8_t* data, uint16_t samples, Point* out) const {
+  switch (layout) {
+    case IDN_LAYOUT_XY16_RGBI8: decodeFixed<1, true>(data, samples, out); break;
+    case IDN_LAYOUT_XY16_RGB8: decodeFixed<1, false>(data, samples, out); break;
+    case IDN_LAYOUT_XY16_RGB16: decodeFixed<2, false>(data, samples, out); break;
+    case IDN_LAYOUT_XY16_RGBI16: decodeFixed<2, true>(data, samples, out); break;
+    default: decodeGeneric(data, samples, out); break;
+  }
+  return samples;
+}
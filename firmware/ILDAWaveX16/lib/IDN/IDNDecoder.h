@@ -0,0 +1,58 @@
+#ifndef IDNDECODER_H
+#define IDNDECODER_H
+
+#include <Arduino.h>
+#include <ILDA.h>
+#include "idn-stream.h"
+
+// Service data tags (IDN-Stream, laser projector graphic data)
+#define IDNTAG_VOID                         0x0000      // Padding, no sample data
+#define IDNTAG_PRECISION                    0x4010      // Previous tag carries one more octet
+#define IDNTAG_X                            0x4200      // Draw control: X
+#define IDNTAG_Y                            0x4210      // Draw control: Y
+#define IDNTAG_Z                            0x4220      // Draw control: Z
+#define IDNTAG_COLOR                        0x5000      // Color, lower 10 bits: wavelength [nm]
+#define IDNMSK_COLOR                        0xFC00
+#define IDNMSK_COLOR_WAVELENGTH             0x03FF
+#define IDNTAG_INTENSITY                    0x5C10      // Beam intensity
+
+#define IDN_MAX_FIELDS 16
+#define IDN_MAX_SAMPLE_SIZE 64 // octets
+
+enum IDNFieldTarget : uint8_t { IDN_FIELD_SKIP, IDN_FIELD_X, IDN_FIELD_Y, IDN_FIELD_R, IDN_FIELD_G, IDN_FIELD_B, IDN_FIELD_I };
+
+// Sample layouts with a dedicated decoder, anything else goes through the field table
+enum IDNLayout : uint8_t {
+  IDN_LAYOUT_XY16_RGBI8, // 8 B, default without configuration
+  IDN_LAYOUT_XY16_RGB8, // 7 B
+  IDN_LAYOUT_XY16_RGB16, // 10 B
+  IDN_LAYOUT_XY16_RGBI16, // 12 B
+  IDN_LAYOUT_GENERIC
+};
+
+typedef struct {
+  uint8_t target;
+  uint8_t offset; // within the sample
+  uint8_t width; // octets
+} IDNSampleField;
+
+// Channel configuration parsed from the service configuration header and its tag dictionary
+class IDNChannelConfig {
+  public:
+    void reset();
+    uint8_t parse(const IDNHDR_CHANNEL_CONFIG* cfg, const uint16_t* tags); // 0 = ok
+    uint16_t decode(const uint8_t* data, uint16_t samples, Point* out) const;
+
+    uint8_t flags = 0;
+    uint8_t serviceID = 0;
+    uint8_t serviceMode = IDNVAL_SMOD_LPGRF_CONTINUOUS;
+    uint8_t sampleSize = 8;
+    uint8_t layout = IDN_LAYOUT_XY16_RGBI8;
+    uint8_t fieldCount = 0;
+    IDNSampleField fields[IDN_MAX_FIELDS];
+
+  private:
+    void decodeGeneric(const uint8_t* data, uint16_t samples, Point* out) const;
+};
+
+#endif /* IDNDECODER_H */
@@ -0,0 +1,83 @@
+#include "IDNFrameBuffer.h"
+
+static Point* allocFrame() {
+  size_t size = IDN_FRAME_POINTS * sizeof(Point);
+  Point* p = (Point*)heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+  if (!p) p = (Point*)heap_caps_malloc(size, MALLOC_CAP_8BIT);
+  return p;
+}
+
+bool IDNFrameBuffer::begin() {
+  if (!frontPoints) frontPoints = allocFrame();
+  if (!backPoints) backPoints = allocFrame();
+  return frontPoints && backPoints;
+}
+
+void IDNFrameBuffer::start(const IDNChannelConfig* cfg, uint8_t flags, uint32_t duration) {
+  config = cfg;
+  backCount = 0;
+  backDuration = duration;
+  backOnce = flags & IDNFLG_GRAPHIC_FRAME_ONCE;
+  carryLen = 0;
+  published = false;
+  assembling = true;
+}
+
+// Fragments may split a sample, the partial sample is kept until the next fragment completes it
+void IDNFrameBuffer::append(const uint8_t* data, uint16_t len) {
+  if (!assembling) return;
+  uint8_t size = config->sampleSize;
+
+  if (carryLen > 0) {
+    uint8_t n = min<uint16_t>(size - carryLen, len);
+    memcpy(&carry[carryLen], data, n);
+    carryLen += n;
+    data += n;
+    len -= n;
+    if (carryLen < size) return;
+    if (backCount < IDN_FRAME_POINTS) config->decode(carry, 1, &backPoints[backCount++]);
+    else truncated++;
+    carryLen = 0;
+  }
+
+  uint16_t samples = len / size;
+  uint16_t fit = min<uint16_t>(samples, IDN_FRAME_POINTS - backCount);
+  config->decode(data, fit, &backPoints[backCount]);
+  backCount += fit;
+  truncated += samples - fit;
+
+  carryLen = len - samples * size;
+  memcpy(carry, data + samples * size, carryLen);
+}
+
+void IDNFrameBuffer::finish() {
+  if (!assembling) return;
+  assembling = false;
+  if (backCount == 0) return;
+  published = true;
+  frames++;
+}
+
+void IDNFrameBuffer::abort() {
+  if (assembling) aborted++;
+  assembling = false;
+}
+
+bool IDNFrameBuffer::swap() {
+  if (!published) return false;
+  Point* t = frontPoints;
+  frontPoints = backPoints;
+  backPoints = t;
+  frontCount = backCount;
+  frontDuration = backDuration;
+  frontOnce = backOnce;
+  backCount = 0;
+  published = false;
+  return true;
+}
+
+void IDNFrameBuffer::clear() {
+  assembling = false;
+  published = false;
+  frontCount = 0;
+}
@@ -0,0 +1,45 @@
+#ifndef IDNFRAMEBUFFER_H
+#define IDNFRAMEBUFFER_H
+
+#include <Arduino.h>
+#include <ILDA.h>
+#include "IDNDecoder.h"
+
+#define IDN_FRAME_POINTS 4096 // per frame, larger frames are truncated
+
+// Double buffered frame store for the discrete graphic mode. Fragments are decoded into the
+// back buffer as they arrive; a complete frame is published and taken over by the front
+// buffer only at the next frame boundary, so output never shows a partial frame.
+class IDNFrameBuffer {
+  public:
+    bool begin(); // allocates both buffers on first use, PSRAM when available
+    void start(const IDNChannelConfig* config, uint8_t flags, uint32_t duration);
+    void append(const uint8_t* data, uint16_t len);
+    void finish();
+    void abort();
+    bool swap(); // at a frame boundary: take over a published frame
+    void clear();
+
+    const Point* front() const { return frontPoints; }
+    uint16_t frontCount = 0;
+    uint32_t frontDuration = 0; // [us], 0 = not specified
+    bool frontOnce = false; // IDNFLG_GRAPHIC_FRAME_ONCE
+    bool assembling = false;
+
+    uint32_t frames = 0; // complete frames received
+    uint32_t aborted = 0; // incomplete frames discarded
+    uint32_t truncated = 0; // samples beyond IDN_FRAME_POINTS
+
+  private:
+    Point* frontPoints = nullptr;
+    Point* backPoints = nullptr;
+    uint16_t backCount = 0;
+    uint32_t backDuration = 0;
+    bool backOnce = false;
+    bool published = false;
+    const IDNChannelConfig* config = nullptr;
+    uint8_t carry[IDN_MAX_SAMPLE_SIZE]; // sample split across fragments
+    uint8_t carryLen = 0;
+};
+
+#endif /* IDNFRAMEBUFFER_H */
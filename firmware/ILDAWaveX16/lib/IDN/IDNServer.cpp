@@ -1,27 +1,330 @@
 #include "IDNServer.h"
 
 void IDNServer::begin() {
+  resampler.reset();
+  jitter.reset();
+  for (uint8_t i = 0; i < IDNVAL_CHANNEL_COUNT; i++) {
+    channels[i].open = false;
+    channels[i].configured = false;
+    channels[i].config.reset();
+  }
+  activeChannel = -1;
+  // Fragmented datagrams arrive reassembled, a single MTU sized buffer cut them short
+  if (!netRxBuffer) netRxBuffer = (uint8_t*)heap_caps_malloc(IDN_RX_BUFFER, MALLOC_CAP_SPIRAM);
+  if (!netRxBuffer) netRxBuffer = (uint8_t*)heap_caps_malloc(IDN_RX_BUFFER, MALLOC_CAP_8BIT);
+  if (!netRxBuffer) return;
   udp.begin(IDNVAL_HELLO_UDP_PORT);
   Serial.printf("IDN UDP Port: %i\n", IDNVAL_HELLO_UDP_PORT);
-  udpOpen = 1;
 }
 
 void IDNServer::stop() {
   udp.stop();
-  udpOpen = 0;
 }
 
 void IDNServer::setRendererHandle(Renderer* renderer) {
   rendererPtr = renderer;
 }
 
+// Schedule a chunk against its timestamp: pads ahead of early chunks, returns the number of
+// output points to skip for late ones
+uint16_t IDNServer::schedule(uint16_t samples, uint32_t timestamp) {
+  uint32_t pps = rendererPtr->point_rate;
+  uint16_t skip = 0;
+  uint32_t gap = 0;
+
+  if (resampleEnabled) {
+    resampler.setOutputRate(pps);
+    resampler.addTimestamp(timestamp, samples);
+  }
+
+  if (jitterEnabled) {
+    uint32_t queued = (uint64_t)rendererPtr->buffer_fill(SOURCE_IDN) * 1000000 / pps;
+    uint16_t points = samples;
+    if (resampleEnabled && !resampler.bypass) points = min((float)samples * pps / resampler.inputRate, 65535.0f);
+    jitter.schedule(timestamp, micros(), queued, pps, points, skip, gap);
+  }
+
+  // Early chunk: hold the last position blanked until its playout time
+  Point pad[64];
+  for (uint8_t i = 0; i < 64; i++) pad[i] = { lastPoint.x, lastPoint.y, 0, 0, 0, 0 };
+  while (gap > 0) {
+    uint16_t n = min(gap, (uint32_t)64);
+    rendererPtr->buffer_add_points(SOURCE_IDN, pad, n);
+    gap -= n;
+  }
+  return skip;
+}
+
+// Convert decoded points to the output rate and queue them, dropping `skip` leading output points
+void IDNServer::emit(const Point* p, uint16_t samples, uint16_t& skip) {
+  uint16_t done = 0;
+  while (done < samples) {
+    const Point* out = &p[done];
+    uint16_t n = samples - done;
+    if (resampleEnabled) {
+      uint16_t used;
+      n = resampler.process(&p[done], samples - done, used, resampleBuffer, IDN_RESAMPLE_BUFFER);
+      out = resampleBuffer;
+      done += used;
+    }
+    else done = samples;
+
+    // Late chunk: skip leading points to catch up with the playout time
+    uint16_t drop = min(skip, n);
+    skip -= drop;
+    if (n > drop) {
+      rendererPtr->recorder.add(SOURCE_IDN, &out[drop], n - drop);
+      rendererPtr->buffer_add_points(SOURCE_IDN, &out[drop], n - drop);
+      lastPoint = out[n - 1];
+    }
+  }
+}
+
+// Wave chunk: at the output rate the samples are decoded in place into the point buffer,
+// otherwise in slices through the resampler
+void IDNServer::outputWave(const IDNChannelConfig& config, const uint8_t* data, uint16_t samples, uint32_t timestamp) {
+  uint32_t start = ESP.getCycleCount();
+  uint16_t total = samples;
+  uint16_t skip = schedule(samples, timestamp);
+
+  if (!resampleEnabled || resampler.bypass) {
+    uint16_t drop = min(skip, samples);
+    data += drop * config.sampleSize;
+    samples -= drop;
+    while (samples > 0) {
+      Point* dst;
+      uint16_t n = rendererPtr->buffer_reserve(SOURCE_IDN, dst, samples);
+      if (n == 0) break; // buffer full, rest of the chunk is lost
+      config.decode(data, n, dst);
+      if (!rendererPtr->buffer_commit(SOURCE_IDN, dst, n)) break;
+      // Committed span is only reused after the ring wraps back to it, which needs this task to produce again
+      rendererPtr->recorder.add(SOURCE_IDN, dst, n);
+      lastPoint = dst[n - 1];
+      data += n * config.sampleSize;
+      samples -= n;
+    }
+    if (samples > 0) rendererPtr->buffer_discard(SOURCE_IDN, samples); // counted like addPoints() does
+  }
+  else {
+    while (samples > 0) {
+      uint16_t n = min<uint16_t>(samples, IDN_DECODE_BUFFER);
+      config.decode(data, n, decodeBuffer);
+      emit(decodeBuffer, n, skip);
+      data += n * config.sampleSize;
+      samples -= n;
+    }
+  }
+
+  if (total > 0) decodeCycles += ((float)(ESP.getCycleCount() - start) / total - decodeCycles) / 16;
+}
+
+// Ownership, sequence and activity bookkeeping. A channel belongs to the first sender that
+// opens it until it is closed or falls silent for channelTimeout.
+bool IDNServer::admit(uint8_t id, uint32_t ip, uint16_t port, uint16_t sequence) {
+  IDNChannel& ch = channels[id];
+  uint32_t now = millis();
+
+  if (ch.open && (ch.ownerIP != ip || ch.ownerPort != port)) {
+    if (now - ch.lastActivity < channelTimeout) { packetsRejected++; return false; }
+    closeChannel(id); // stale owner
+  }
+  if (!ch.open) {
+    ch.open = true;
+    ch.ownerIP = ip;
+    ch.ownerPort = port;
+    ch.lastSequence = sequence - 1;
+    ch.config.reset();
+    ch.configured = false;
+    ch.closeRequested = false;
+  }
+  ch.lastActivity = now;
+
+  int16_t diff = sequence - ch.lastSequence;
+  if (diff <= 0) { packetsReordered++; return false; } // late duplicate or reordered, already superseded
+  packetsLost += diff - 1;
+
+  // The packet sequence counts per sender, not per channel
+  for (uint8_t i = 0; i < IDNVAL_CHANNEL_COUNT; i++) {
+    if (channels[i].open && channels[i].ownerIP == ip && channels[i].ownerPort == port) channels[i].lastSequence = sequence;
+  }
+  return true;
+}
+
+// Only the active channel feeds the renderer; first owner keeps the output until it closes,
+// with priority arbitration a lower channel ID takes over immediately
+bool IDNServer::isActive(uint8_t id) {
+  if (activeChannel == id) return true;
+  if (activeChannel >= 0 && !(arbitration == IDN_ARBITRATION_PRIORITY && id < activeChannel)) return false;
+  activate(id);
+  return true;
+}
+
+// Drop everything queued from the previous source so the switch is immediate
+void IDNServer::activate(int8_t id) {
+  activeChannel = id;
+  rendererPtr->buffer_clear_points(SOURCE_IDN);
+  frame.clear();
+  frameMode = false;
+  replayPos = 0;
+  resampler.reset();
+  jitter.reset();
+  lastPoint = {};
+  channelSwitches++;
+}
+
+void IDNServer::closeChannel(uint8_t id) {
+  channels[id].open = false;
+  if (activeChannel != id) return;
+
+  // Hand over to the lowest open channel that is still alive
+  uint32_t now = millis();
+  int8_t next = -1;
+  for (uint8_t i = 0; i < IDNVAL_CHANNEL_COUNT; i++) {
+    if (channels[i].open && now - channels[i].lastActivity < channelTimeout) { next = i; break; }
+  }
+  activate(next);
+}
+
+void IDNServer::closeSession(uint32_t ip, uint16_t port) {
+  for (uint8_t i = 0; i < IDNVAL_CHANNEL_COUNT; i++) {
+    if (channels[i].open && channels[i].ownerIP == ip && channels[i].ownerPort == port) closeChannel(i);
+  }
+}
+
+void IDNServer::touchSession(uint32_t ip, uint16_t port) {
+  uint32_t now = millis();
+  for (uint8_t i = 0; i < IDNVAL_CHANNEL_COUNT; i++) {
+    if (channels[i].open && channels[i].ownerIP == ip && channels[i].ownerPort == port) channels[i].lastActivity = now;
+  }
+}
+
+// Returns the channel ID when the message was admitted, -1 otherwise
+int8_t IDNServer::channelMessage(uint16_t sequence, int len, uint32_t ip, uint16_t port) {
+  IDNHDR_CHANNEL_MESSAGE* recvChannelMsg = (IDNHDR_CHANNEL_MESSAGE*)&netRxBuffer[sizeof(IDNHDR_PACKET)];
+  uint16_t channelMsgTotalSize = ntohs(recvChannelMsg->totalSize);
+  uint16_t channelMsgContentID = ntohs(recvChannelMsg->contentID);
+  uint32_t channelMsgTimestamp = ntohl(recvChannelMsg->timestamp);
+  // Serial.printf("%u\t%04X\t%u\n", channelMsgTotalSize, channelMsgContentID, channelMsgTimestamp);
+
+  uint8_t chunkType = channelMsgContentID & IDNMSK_CONTENTID_CNKTYPE;
+  uint8_t channelID = (channelMsgContentID & IDNMSK_CONTENTID_CHANNELID) >> 8;
+  IDNChannel& channel = channels[channelID];
+  IDNChannelConfig& config = channel.config;
+  uint8_t* payload = (uint8_t*)&recvChannelMsg[1];
+
+  // Validate once: a truncated datagram or a size below the headers drops the message
+  if (channelMsgTotalSize < sizeof(IDNHDR_CHANNEL_MESSAGE) || sizeof(IDNHDR_PACKET) + channelMsgTotalSize > (size_t)len) { malformed++; return -1; }
+  uint8_t* end = netRxBuffer + sizeof(IDNHDR_PACKET) + channelMsgTotalSize;
+
+  if (!admit(channelID, ip, port, sequence)) return -1;
+  bool active = isActive(channelID);
+
+  // Sequel fragments carry only sample octets, the last one is flagged like a config header
+  if (chunkType == IDNVAL_CNKTYPE_LPGRF_FRAME_SEQUEL) {
+    if (!active) return channelID;
+    if (!frame.assembling || channelID != frameChannel || sequence != (uint16_t)(frameSequence + 1)) { frame.abort(); return channelID; }
+    frameSequence = sequence;
+    frame.append(payload, end - payload);
+    if (channelMsgContentID & IDNFLG_CONTENTID_CONFIG_LSTFRG) frame.finish();
+    return channelID;
+  }
+
+  if (channelMsgContentID & IDNFLG_CONTENTID_CONFIG_LSTFRG) {
+    IDNHDR_CHANNEL_CONFIG* channelConfig = (IDNHDR_CHANNEL_CONFIG*)payload;
+    uint8_t* tags = (uint8_t*)&channelConfig[1];
+    if (tags > end || tags + channelConfig->wordCount * 4 > end) return channelID;
+    channel.closeRequested = channelConfig->flags & IDNFLG_CHNCFG_CLOSE;
+    if (channelConfig->flags & IDNFLG_CHNCFG_ROUTING) {
+      // (Re)opened by the sender: restart rate estimation and scheduling
+      if (active) { resampler.reset(); jitter.reset(); }
+    }
+    if (config.parse(channelConfig, (const uint16_t*)tags) != 0) { config.reset(); return channelID; }
+    channel.configured = true;
+    payload = tags + channelConfig->wordCount * 4;
+  }
+
+  if (!active) return channelID;
+  if (chunkType != IDNVAL_CNKTYPE_LPGRF_WAVE && chunkType != IDNVAL_CNKTYPE_LPGRF_FRAME && chunkType != IDNVAL_CNKTYPE_LPGRF_FRAME_FIRST) return channelID;
+
+  IDNHDR_SAMPLE_CHUNK* sampleChunkHdr = (IDNHDR_SAMPLE_CHUNK*)payload;
+  uint8_t* data = (uint8_t*)&sampleChunkHdr[1];
+  if (data > end) return channelID;
+
+  // Data was produced for another configuration, wait for the sender to repeat it
+  uint32_t flagsDuration = ntohl(sampleChunkHdr->flagsDuration);
+  uint8_t chunkFlags = flagsDuration >> 24;
+  if (channel.configured && ((chunkFlags ^ config.flags) & 0x30)) { configMismatch++; return channelID; }
+
+  if (chunkType == IDNVAL_CNKTYPE_LPGRF_WAVE) {
+    if (frameMode) { frameMode = false; frame.clear(); resampler.reset(); }
+    outputWave(config, data, (end - data) / config.sampleSize, channelMsgTimestamp);
+    return channelID;
+  }
+
+  if (!frame.begin()) return channelID; // no memory for frame buffers
+  if (!frameMode) { frameMode = true; frame.clear(); replayPos = 0; resampler.reset(); }
+  frame.abort(); // a new frame replaces one still missing fragments
+  frame.start(&config, chunkFlags, flagsDuration & 0x00FFFFFF);
+  frameChannel = channelID;
+  frameSequence = sequence;
+  frame.append(data, end - data);
+  if (chunkType == IDNVAL_CNKTYPE_LPGRF_FRAME) frame.finish();
+  return channelID;
+}
+
+// Repeat the current frame locally, keeping about IDN_FRAME_QUEUE of points queued.
+// New frames are taken over only when the current one has been scanned completely.
+void IDNServer::replay() {
+  if (!frameMode) return;
+  uint32_t pps = rendererPtr->point_rate;
+  uint32_t low = (uint64_t)pps * IDN_FRAME_QUEUE / 1000000;
+
+  while (rendererPtr->buffer_fill(SOURCE_IDN) < low) {
+    if (replayPos >= frame.frontCount) {
+      replayPos = 0;
+      if (frame.swap()) {
+        rendererPtr->recorder.frame(SOURCE_IDN, frame.front(), frame.frontCount); // once, not every repeat
+        float rate = frame.frontDuration ? (float)frame.frontCount * 1000000.0f / frame.frontDuration : pps;
+        resampler.setOutputRate(pps);
+        resampler.setInputRate(rate);
+      }
+      else if (frame.frontOnce) frame.frontCount = 0; // scanned once, stay blank until the next frame
+      if (frame.frontCount == 0) return;
+    }
+
+    const Point* in = &frame.front()[replayPos];
+    uint16_t n = min<uint16_t>(frame.frontCount - replayPos, IDN_RESAMPLE_BUFFER);
+    if (resampleEnabled) {
+      uint16_t used;
+      resampler.setOutputRate(pps);
+      n = resampler.process(in, frame.frontCount - replayPos, used, resampleBuffer, IDN_RESAMPLE_BUFFER);
+      in = resampleBuffer;
+      replayPos += used;
+    }
+    else replayPos += n;
+
+    if (n > 0) {
+      rendererPtr->buffer_add_points(SOURCE_IDN, in, n);
+      lastPoint = in[n - 1];
+    }
+  }
+}
+
 void IDNServer::loop() {
-  if (udpOpen == 0 || udp.parsePacket() == 0) return;
+  if (activeChannel >= 0 && millis() - channels[activeChannel].lastActivity >= channelTimeout) closeChannel(activeChannel);
+  replay();
+
+  // Drain everything queued since the last wakeup
+  int len;
+  uint32_t truncated = udp.truncated;
+  while ((len = udp.receive(netRxBuffer, IDN_RX_BUFFER)) >= 0) {
+    if (udp.truncated != truncated) truncated = udp.truncated; // oversize, the socket counted it, never parsed
+    else if (len >= (int)sizeof(IDNHDR_PACKET)) handlePacket(len);
+    udp.processed();
+  }
+}
 
-  int len = udp.read(netRxBuffer, sizeof(netRxBuffer));
-  // if (len != 4) return; // IDNHDR_PACKET
-  if (len == 0) return; // didn't read anything
-  
+void IDNServer::handlePacket(int len) {
   IDNHDR_PACKET *recvPacketHdr = (IDNHDR_PACKET *)(netRxBuffer);
   unsigned short recvSequence = ntohs(recvPacketHdr->sequence);
   uint8_t cmd = recvPacketHdr->command;
@@ -62,11 +365,7 @@ void IDNServer::loop() {
       sprintf((char*)scanRspHdr->hostName, IDN_HOSTNAME); // copy host name
 
       // Send response back to requester
-      udp.beginPacket(udp.remoteIP(), udp.remotePort());
-      udp.write(netTxBuffer, sendLen);
-      udp.endPacket();
-      // Serial.println(udp.endPacket());
-      // Serial.printf("Send to IP: %s\n", udp.remoteIP().toString().c_str());
+      udp.reply(netTxBuffer, sendLen);
       break;
     }
 
@@ -97,7 +396,7 @@ void IDNServer::loop() {
       
       IDNHDR_SERVICEMAP_ENTRY *mapEntry = &serviceTable[serviceCount];
       mapEntry->serviceID = 0x01;
-      mapEntry->serviceType = IDNVAL_SMOD_LPGRF_CONTINUOUS;
+      mapEntry->serviceType = IDNVAL_STYPE_LAPRO; // continuous and discrete graphic modes
       mapEntry->flags = flags;
       mapEntry->relayNumber = 0;
       memset(mapEntry->name, 0, sizeof(mapEntry->name));
@@ -140,55 +439,30 @@ void IDNServer::loop() {
       // ---------------------------------------------
 
       // Send response back to requester
-      udp.beginPacket(udp.remoteIP(), udp.remotePort());
-      udp.write(netTxBuffer, sendLen);
-      udp.endPacket();
-      // Serial.printf("Send to IP: %s\n", udp.remoteIP().toString().c_str());
+      udp.reply(netTxBuffer, sendLen);
       break;
     }
-    case IDNCMD_RT_CNLMSG: {     
-      IDNHDR_CHANNEL_MESSAGE* recvChannelMsg = (IDNHDR_CHANNEL_MESSAGE*)&recvPacketHdr[1];
-      uint16_t channelMsgTotalSize = ntohs(recvChannelMsg->totalSize);
-      uint16_t channelMsgContentID = ntohs(recvChannelMsg->contentID);
-      uint32_t channelMsgTimestamp = ntohl(recvChannelMsg->timestamp);
-      // Serial.printf("%u\t%04X\t%u\n", channelMsgTotalSize, channelMsgContentID, channelMsgTimestamp);
-      
-      if ((channelMsgContentID & 0x01) == 0) break; // not a wave message
-
-      if (channelMsgContentID & 0x4000) {
-        recvChannelMsg = (IDNHDR_CHANNEL_MESSAGE*)((char*)recvChannelMsg + 20); // skip 20 bytes configuration
-        channelMsgTotalSize -= 20;
+    case IDNCMD_RT_CNLMSG:
+    case IDNCMD_RT_CNLMSG_ACKREQ:
+    case IDNCMD_RT_CNLMSG_CLOSE:
+    case IDNCMD_RT_CNLMSG_CLOSE_ACKREQ: {
+      uint32_t ip = udp.remoteIP();
+      uint16_t port = udp.remotePort();
+      bool close = cmd == IDNCMD_RT_CNLMSG_CLOSE || cmd == IDNCMD_RT_CNLMSG_CLOSE_ACKREQ;
+
+      if (len < (int)(sizeof(IDNHDR_PACKET) + sizeof(IDNHDR_CHANNEL_MESSAGE))) touchSession(ip, port); // empty: keepalive
+      else {
+        int8_t id = channelMessage(recvSequence, len, ip, port);
+        if (id >= 0 && channels[id].closeRequested) closeChannel(id);
       }
-
-      IDNHDR_SAMPLE_CHUNK* sampleChunkHdr = (IDNHDR_SAMPLE_CHUNK*)&recvChannelMsg[1];
-
-      byte* data = (byte*)&sampleChunkHdr[1];
-
-      uint16_t samples = (channelMsgTotalSize - 12) / 8;
-      
-      Point p[512];
-      
-      for (int a = 0; a < samples; a++) {
-        int offset = a * 8;
-
-        p[a].x = (data[offset] << 8) | data[offset + 1];
-        p[a].y = (data[offset + 2] << 8) | data[offset + 3];
-        p[a].r = data[offset + 4];
-        p[a].g = data[offset + 5];
-        p[a].b = data[offset + 6]; 
-        // uint8_t i = data[offset + 7];
-
-        p[a].x = p[a].x + 0x8000;
-        p[a].y = -p[a].y + 0x8000;   
-
-        p[a].r = (p[a].r << 8) | p[a].r;
-        p[a].g = (p[a].g << 8) | p[a].g;
-        p[a].b = (p[a].b << 8) | p[a].b;
-      }
-
-      rendererPtr->buffer_add_points(p, samples);
+      if (close) closeSession(ip, port);
+      break;
     }
 
+    case IDNCMD_RT_ABORT:
+      closeSession(udp.remoteIP(), udp.remotePort());
+      break;
+
   }
 
 }
\ No newline at end of file
@@ -2,34 +2,85 @@
 #define IDNSERVER_H
 
 #include <Arduino.h>
-#include <WiFiUdp.h>
+#include <UDPSocket.h>
 #include <Renderer.h>
+#include <PointResampler.h>
+#include "JitterBuffer.h"
+#include "IDNDecoder.h"
+#include "IDNFrameBuffer.h"
 #include "idn.h"
 #include "idn-stream.h"
 #include "idn-hello.h"
 
 #define IDN_HOSTNAME "IldaWaveX16"
 #define IDN_SERVICE_NAME "IDNService"
+#define IDN_RESAMPLE_BUFFER 1024
+#define IDN_DECODE_BUFFER 128 // resampler input slice, the bypass path decodes in place
+#define IDN_CHANNEL_TIMEOUT 1000 // [ms] silent channels are released
+#define IDN_FRAME_QUEUE 20000 // [us] points kept queued while repeating a frame
+#define IDN_RX_BUFFER 8192 // largest datagram parsed, larger ones are dropped and counted as truncated
 
-// #define DICT_X 0x4200
-// #define DICT_Y 0x4210
-// #define DICT_PREC_16b 0x4010
-// #define DICT_RED_638 0x527E // 638 nm
-// #define DICT_GREEN_532 0x5214 // 532 nm
-// #define DICT_BLUE_460 0x51CC // 460 nm
+enum IDNArbitration : uint8_t { IDN_ARBITRATION_FIRST_OWNER, IDN_ARBITRATION_PRIORITY };
+
+typedef struct {
+  IDNChannelConfig config;
+  bool configured;
+  bool open;
+  bool closeRequested; // IDNFLG_CHNCFG_CLOSE, close after processing
+  uint32_t ownerIP;
+  uint16_t ownerPort;
+  uint16_t lastSequence;
+  uint32_t lastActivity; // [ms]
+} IDNChannel;
 
 class IDNServer {
   public:
     void begin();
     void stop();
     void setRendererHandle(Renderer* renderer);
-    void loop();
+    void loop(); // drains all pending datagrams, call after UDPSocket::wait()
+
+    bool resampleEnabled = true; // convert the sender's sample rate to the renderer point rate
+    PointResampler resampler;
+    bool jitterEnabled = true; // schedule chunks against their IDN timestamps
+    JitterBuffer jitter;
+    uint32_t configMismatch = 0; // chunks dropped for a stale channel configuration
+    UDPSocket udp;
+    IDNFrameBuffer frame;
+    bool frameMode = false; // discrete graphic mode, the last frame is repeated locally
+    uint8_t arbitration = IDN_ARBITRATION_FIRST_OWNER;
+    uint32_t channelTimeout = IDN_CHANNEL_TIMEOUT;
+    int8_t activeChannel = -1;
+    uint32_t packetsLost = 0;
+    uint32_t packetsReordered = 0;
+    uint32_t packetsRejected = 0; // channel held by another sender
+    uint32_t channelSwitches = 0;
+    uint32_t malformed = 0; // truncated or inconsistent channel messages
+    float decodeCycles = 0; // CPU cycles per wave sample, decode and queueing
   private:
-    WiFiUDP udp;
-    uint8_t udpOpen;
+    uint16_t schedule(uint16_t samples, uint32_t timestamp);
+    void emit(const Point* p, uint16_t samples, uint16_t& skip);
+    void outputWave(const IDNChannelConfig& config, const uint8_t* data, uint16_t samples, uint32_t timestamp);
+    void replay();
+    void handlePacket(int len);
+    int8_t channelMessage(uint16_t sequence, int len, uint32_t ip, uint16_t port);
+    bool admit(uint8_t id, uint32_t ip, uint16_t port, uint16_t sequence);
+    bool isActive(uint8_t id);
+    void activate(int8_t id);
+    void closeChannel(uint8_t id);
+    void closeSession(uint32_t ip, uint16_t port);
+    void touchSession(uint32_t ip, uint16_t port);
+
     Renderer* rendererPtr = nullptr;
-    uint8_t netRxBuffer[1500];
+    uint8_t* netRxBuffer = nullptr; // IDN_RX_BUFFER, PSRAM when present
     uint8_t netTxBuffer[256];
+    IDNChannel channels[IDNVAL_CHANNEL_COUNT];
+    Point decodeBuffer[IDN_DECODE_BUFFER];
+    Point resampleBuffer[IDN_RESAMPLE_BUFFER];
+    Point lastPoint = {};
+    uint16_t replayPos = 0;
+    uint8_t frameChannel = 0;
+    uint16_t frameSequence = 0;
 };
 
 #endif /* IDNSERVER_H */
\ No newline at end of file
@@ -0,0 +1,55 @@
+#include "JitterBuffer.h"
+
+void JitterBuffer::reset() {
+  synced = false;
+  latency = JITTER_MIN_LATENCY;
+  jitter = 0;
+}
+
+// timestamp: sender clock of the chunk's first sample [us]
+// now: local arrival time [us], queued: output time of points already in the renderer [us]
+// skip: leading points to drop, gap: blanked points to insert before the chunk
+void JitterBuffer::schedule(uint32_t timestamp, uint32_t now, uint32_t queued, uint32_t pps, uint16_t points, uint16_t& skip, uint32_t& gap) {
+  skip = 0;
+  gap = 0;
+  if (synced && timestamp == lastTimestamp) return; // sender doesn't provide timestamps
+  lastTimestamp = timestamp;
+  int32_t offset = (int32_t)(now - timestamp);
+
+  if (!synced || abs(offset - minOffset) > 1000000) { // first chunk or sender clock jumped
+    minOffset = windowMin = prevWindowMin = offset;
+    windowStart = now;
+    latency = JITTER_MIN_LATENCY;
+    jitter = 0;
+    synced = true;
+  }
+
+  // Sliding minimum of the transit offset, tolerant to slow clock drift
+  if (offset - windowMin < 0) windowMin = offset;
+  if (now - windowStart > JITTER_WINDOW) {
+    prevWindowMin = windowMin;
+    windowMin = offset;
+    windowStart = now;
+  }
+  minOffset = (windowMin - prevWindowMin < 0) ? windowMin : prevWindowMin;
+
+  // Jitter peak with slow decay, target latency follows it within the user cap
+  uint32_t transit = (uint32_t)(offset - minOffset);
+  jitter = max(transit, jitter - (jitter >> 6));
+  uint32_t target = constrain(jitter + (jitter >> 2), (uint32_t)JITTER_MIN_LATENCY, max(maxLatency, (uint32_t)JITTER_MIN_LATENCY));
+  latency += ((int32_t)(target - latency)) / 8;
+
+  // Compare the chunk's playout time with the time its first point would be output
+  int32_t due = (int32_t)(timestamp + minOffset + latency - now); // [us] from now
+  int32_t error = (int32_t)queued - due; // >0: late, <0: early
+  if (error > JITTER_TOLERANCE) {
+    uint32_t late = (uint64_t)error * pps / 1000000;
+    if (late >= points) { skip = points; lateChunks++; }
+    else skip = late;
+    latePoints += skip;
+  }
+  else if (error < -JITTER_TOLERANCE) {
+    gap = min((uint64_t)(-error) * pps / 1000000, (uint64_t)latency * pps / 1000000);
+    gapPoints += gap;
+  }
+}
@@ -0,0 +1,36 @@
+#ifndef JITTERBUFFER_H
+#define JITTERBUFFER_H
+
+#include <Arduino.h>
+
+#define JITTER_MIN_LATENCY 2000 // [us] floor of the adaptive target latency
+#define JITTER_MAX_LATENCY 30000 // [us] default user cap
+#define JITTER_LATENCY_LIMIT 500000 // [us] highest cap accepted by /control?idn_latency, 2000 us is the lowest
+#define JITTER_TOLERANCE 1000 // [us] scheduling error accepted without gap fill or compression
+#define JITTER_WINDOW 2000000 // [us] transit minimum tracking window
+
+// Maps sender timestamps to local playout times. The renderer point buffer is the actual
+// buffer: each chunk is scheduled against its playout time by padding (early) or
+// skipping leading points (late) relative to what is already queued for output.
+class JitterBuffer {
+  public:
+    void reset();
+    void schedule(uint32_t timestamp, uint32_t now, uint32_t queued, uint32_t pps, uint16_t points, uint16_t& skip, uint32_t& gap);
+
+    uint32_t maxLatency = JITTER_MAX_LATENCY; // [us] user setting
+    uint32_t latency = 0; // [us] current target latency
+    uint32_t jitter = 0; // [us] transit variation peak estimate
+    uint32_t lateChunks = 0; // dropped entirely
+    uint32_t latePoints = 0; // skipped to catch up
+    uint32_t gapPoints = 0; // padding inserted ahead of early chunks
+
+  private:
+    bool synced = false;
+    uint32_t lastTimestamp = 0;
+    int32_t minOffset = 0; // smallest local - sender clock difference seen
+    int32_t windowMin = 0;
+    int32_t prevWindowMin = 0;
+    uint32_t windowStart = 0;
+};
+
+#endif /* JITTERBUFFER_H */
@@ -1,9 +1,11 @@
 #include "ILDA.h"
 
-uint8_t ILDA::readHeader(File file) {
+static const uint8_t bytesPerRecordMap[6] = {8, 6, 3, 0, 10, 8};
+
+uint8_t ILDA::readHeader(File file, SDReader* reader) {
   if (!file) return 1;
 
-  memset(&ildaStream, 0, sizeof(ILDA_Stream));
+  ildaStream = ILDA_Stream();
 
   size_t bytesRead = file.read((uint8_t*)&ildaStream.header, sizeof(ILDA_Header_t));
   if (bytesRead != sizeof(ILDA_Header_t)) return 1;
@@ -20,126 +22,213 @@ uint8_t ILDA::readHeader(File file) {
   ildaStream.current_frame_idx = 0;
   ildaStream.current_record_idx = 0;
 
-  const uint8_t bytesPerRecordMap[6] = {8, 6, 3, 0, 10, 8};
   ildaStream.bytes_per_record = (ildaStream.header.format < 6) ? bytesPerRecordMap[ildaStream.header.format] : 0;
 
   ildaStream.file = file;
+  ildaStream.reader = reader;
+  reader->start(file, ildaStream.data_offset);
 
   Serial.printf("ILDA Stream ready: format=%d, frames=%d, records/frame=%d, data offset=%d, next offset=%d, bytes/record=%d\n", ildaStream.header.format, ildaStream.header.total_frames, ildaStream.header.records, ildaStream.data_offset, ildaStream.next_offset, ildaStream.bytes_per_record);
 
   return 0;
 }
 
+// Load the next section header from the stream, rewinding to the first frame at EOF or terminator
+uint8_t ILDA::nextHeader() {
+  ILDA_Header_t nextHeader;
+  size_t bytes = ildaStream.reader->read((uint8_t*)&nextHeader, sizeof(ILDA_Header_t));
+  ildaStream.next_offset += bytes;
+  nextHeader.records = ntohs(nextHeader.records);
+  nextHeader.total_frames = ntohs(nextHeader.total_frames);
+
+  if (bytes != sizeof(ILDA_Header_t) || nextHeader.records == 0) return rewind(); // EOF or terminator reached
+  if (nextHeader.format > 5 || bytesPerRecordMap[nextHeader.format] == 0) return rewind(); // unsupported section
+
+  // Valid new frame
+  ildaStream.header = nextHeader;
+  ildaStream.bytes_per_record = bytesPerRecordMap[nextHeader.format];
+  ildaStream.current_frame_idx++;
+  ildaStream.current_record_idx = 0;
+  return 0;
+}
+
+uint8_t ILDA::rewind() {
+  ildaStream.reader->seek(0);
+  size_t bytes = ildaStream.reader->read((uint8_t*)&ildaStream.header, sizeof(ILDA_Header_t));
+  if (bytes != sizeof(ILDA_Header_t) || strncmp(ildaStream.header.ilda, "ILDA", 4) != 0) return 1;
+  ildaStream.header.records = ntohs(ildaStream.header.records);
+  ildaStream.header.total_frames = ntohs(ildaStream.header.total_frames);
+  ildaStream.bytes_per_record = (ildaStream.header.format < 6) ? bytesPerRecordMap[ildaStream.header.format] : 0;
+  ildaStream.current_frame_idx = 0;
+  ildaStream.current_record_idx = 0;
+  ildaStream.next_offset = bytes;
+  return ildaStream.bytes_per_record == 0;
+}
+
+// Decode a single record; returns false for palette records, which don't produce a point
+bool ILDA::decodeRecord(const uint8_t* temp, Point& p) {
+  ILDA_Record_t rec = {};
+  uint8_t buf_offset = 0;
+  uint8_t format = ildaStream.header.format;
+
+  if (format == 2) {
+    if (ildaStream.current_record_idx < 64) { // R, G, B in file order, as ilda_palette stores them
+      ilda_palette[ildaStream.current_record_idx][0] = temp[0];
+      ilda_palette[ildaStream.current_record_idx][1] = temp[1];
+      ilda_palette[ildaStream.current_record_idx][2] = temp[2];
+    }
+    return false;
+  }
+
+  memcpy(&rec.x, &temp[buf_offset], sizeof(int16_t)); buf_offset += 2;
+  memcpy(&rec.y, &temp[buf_offset], sizeof(int16_t)); buf_offset += 2;
+  if (format == 0 || format == 4) { memcpy(&rec.z, &temp[buf_offset], sizeof(int16_t)); buf_offset += 2; }
+  rec.status_code = temp[buf_offset++];
+  if (format == 0 || format == 1) rec.color_index = temp[buf_offset++];
+  else {
+    rec.blue = temp[buf_offset++];
+    rec.green = temp[buf_offset++];
+    rec.red = temp[buf_offset++];
+  }
+  rec.x = ntohs(rec.x);
+  rec.y = ntohs(rec.y);
+  rec.z = ntohs(rec.z);
+  if (projecting && (format == 0 || format == 4)) {
+    int16_t x = rec.x, y = rec.y;
+    if (!projection.project(x, y, rec.z)) rec.status_code |= 0b01000000; // behind the near plane
+    rec.x = x;
+    rec.y = y;
+  }
+
+  // Convert to Point
+  p.x = rec.x + 0x8000;
+  p.y = -rec.y + 0x8000;
+  p.i = 0; // ILDA carries no intensity channel
+
+  if ((rec.status_code & 0b01000000) != 0) p.r = p.g = p.b = 0;
+  else if (format == 0 || format == 1) {
+    uint8_t c = rec.color_index & 0x3F;
+    p.r = (ilda_palette[c][0] << 8) | ilda_palette[c][0];
+    p.g = (ilda_palette[c][1] << 8) | ilda_palette[c][1];
+    p.b = (ilda_palette[c][2] << 8) | ilda_palette[c][2];
+  }
+  else {
+    p.r = (rec.red << 8) | rec.red;
+    p.g = (rec.green << 8) | rec.green;
+    p.b = (rec.blue << 8) | rec.blue;
+  }
+  return true;
+}
+
 int ILDA::readILDAChunk(Point* buffer, uint16_t maxPoints) {
-  if (!ildaStream.file || ildaStream.bytes_per_record == 0) return 0;
+  if (!ildaStream.reader || ildaStream.bytes_per_record == 0) return 0;
 
   uint16_t pointsRead = 0;
-  File& f = ildaStream.file;
+  uint8_t temp[ILDA_READ_BATCH * 10];
+  projecting = projection.update();
 
   while (pointsRead < maxPoints) {
 
     // No records left in this frame - load the next header
     if (ildaStream.current_record_idx >= ildaStream.header.records) {
-      ILDA_Header_t nextHeader;
-      size_t bytes = f.read((uint8_t*)&nextHeader, sizeof(ILDA_Header_t));
-      if (bytes != sizeof(ILDA_Header_t)) {
-        // EOF - rewind
-        f.seek(0);
-        f.read((uint8_t*)&ildaStream.header, sizeof(ILDA_Header_t));
-        ildaStream.header.records = ntohs(ildaStream.header.records);
-        ildaStream.header.total_frames = ntohs(ildaStream.header.total_frames);
-        ildaStream.current_frame_idx = 0;
-        ildaStream.current_record_idx = 0;
-        ildaStream.next_offset = f.position();
-        continue;
-      }
-
-      nextHeader.records = ntohs(nextHeader.records);
-      nextHeader.total_frames = ntohs(nextHeader.total_frames);
-
-      if (nextHeader.records == 0) {
-        // Terminator reached - restart from beginning
-        f.seek(0);
-        f.read((uint8_t*)&ildaStream.header, sizeof(ILDA_Header_t));
-        ildaStream.header.records = ntohs(ildaStream.header.records);
-        ildaStream.header.total_frames = ntohs(ildaStream.header.total_frames);
-        ildaStream.current_frame_idx = 0;
-        ildaStream.current_record_idx = 0;
-        ildaStream.next_offset = f.position();
-        continue;
-      }
-
-      // Valid new frame
-      ildaStream.header = nextHeader;
-      ildaStream.current_frame_idx++;
-      ildaStream.current_record_idx = 0;
-      ildaStream.next_offset = f.position();
+      if (nextHeader()) break; // unreadable stream
       continue;
     }
 
-    if (f.position() != ildaStream.next_offset) f.seek(ildaStream.next_offset); // Read single record
-
-    uint8_t temp[10];
-    size_t bytes = f.read(temp, ildaStream.bytes_per_record);
-    if (bytes != ildaStream.bytes_per_record) {
-      // Error - restart stream
-      f.seek(0);
-      f.read((uint8_t*)&ildaStream.header, sizeof(ILDA_Header_t));
-      ildaStream.header.records = ntohs(ildaStream.header.records);
-      ildaStream.header.total_frames = ntohs(ildaStream.header.total_frames);
-      ildaStream.current_frame_idx = 0;
-      ildaStream.current_record_idx = 0;
-      ildaStream.next_offset = f.position();
+    // Read a batch of records from the current frame
+    uint16_t count = min((int)(ildaStream.header.records - ildaStream.current_record_idx), (int)ILDA_READ_BATCH);
+    if (ildaStream.header.format != 2) count = min((int)count, (int)(maxPoints - pointsRead));
+    size_t len = count * ildaStream.bytes_per_record;
+    size_t bytes = ildaStream.reader->read(temp, len);
+    ildaStream.next_offset += bytes;
+    if (bytes != len) {
+      // Truncated frame - restart stream
+      if (rewind()) break;
       continue;
     }
 
-    ILDA_Record_t rec = {};
-    uint8_t buf_offset = 0;
+    for (uint16_t i = 0; i < count; i++) {
+      if (decodeRecord(&temp[i * ildaStream.bytes_per_record], buffer[pointsRead])) pointsRead++;
+      ildaStream.current_record_idx++;
+    }
+  }
+
+  return pointsRead;
+}
+
+// Read exactly one frame, skipping palette sections. Frames larger than maxPoints are evenly decimated.
+int ILDA::readILDAFrame(Point* buffer, uint16_t maxPoints) {
+  if (!ildaStream.reader || ildaStream.bytes_per_record == 0 || maxPoints == 0) return 0;
 
-    if (ildaStream.header.format == 2) {
-      ilda_palette[ildaStream.current_record_idx][2] = temp[buf_offset++];
-      ilda_palette[ildaStream.current_record_idx][1] = temp[buf_offset++];
-      ilda_palette[ildaStream.current_record_idx][0] = temp[buf_offset++];
+  uint8_t temp[ILDA_READ_BATCH * 10];
+  projecting = projection.update();
+
+  for (uint8_t sections = 0; sections < 8; sections++) {
+    if (ildaStream.current_record_idx >= ildaStream.header.records) {
+      if (nextHeader()) return 0; // unreadable stream
     }
-    else {
-      memcpy(&rec.x, &temp[buf_offset], sizeof(int16_t)); buf_offset += 2;
-      memcpy(&rec.y, &temp[buf_offset], sizeof(int16_t)); buf_offset += 2;
-      if (ildaStream.header.format == 0 || ildaStream.header.format == 4) memcpy(&rec.z, &temp[buf_offset], sizeof(int16_t)); buf_offset += 2;
-      rec.status_code = temp[buf_offset++];
-      if (ildaStream.header.format == 0 || ildaStream.header.format == 1) rec.color_index = temp[buf_offset++];
-      else if (ildaStream.header.format == 4 || ildaStream.header.format == 5) {
-        rec.blue = temp[buf_offset++];
-        rec.green = temp[buf_offset++];
-        rec.red = temp[buf_offset++];
+
+    uint16_t records = ildaStream.header.records;
+    uint16_t kept = 0;
+    while (ildaStream.current_record_idx < records) {
+      uint16_t count = min((int)(records - ildaStream.current_record_idx), (int)ILDA_READ_BATCH);
+      size_t len = count * ildaStream.bytes_per_record;
+      size_t bytes = ildaStream.reader->read(temp, len);
+      ildaStream.next_offset += bytes;
+      if (bytes != len) { rewind(); return 0; } // truncated frame
+
+      for (uint16_t i = 0; i < count; i++) {
+        uint32_t slot = (uint32_t)ildaStream.current_record_idx * maxPoints / records;
+        if (slot >= kept && decodeRecord(&temp[i * ildaStream.bytes_per_record], buffer[kept])) kept++;
+        ildaStream.current_record_idx++;
       }
-      rec.x = ntohs(rec.x);
-      rec.y = ntohs(rec.y);
-      rec.z = ntohs(rec.z);
     }
 
-    // Convert to Point
-    Point& p = buffer[pointsRead];
-    p.x = rec.x + 0x8000;
-    p.y = -rec.y + 0x8000;
-
-    if ((rec.status_code & 0b01000000) != 0) p.r = p.g = p.b = 0;
-    else {
-      if (ildaStream.header.format == 0 || ildaStream.header.format == 1) {
-        p.r = (ilda_palette[rec.color_index][0] << 8) | ilda_palette[rec.color_index][0];
-        p.g = (ilda_palette[rec.color_index][1] << 8) | ilda_palette[rec.color_index][1];
-        p.b = (ilda_palette[rec.color_index][2] << 8) | ilda_palette[rec.color_index][2];
-      }
-      else if (ildaStream.header.format == 4 || ildaStream.header.format == 5) {
-        p.r = (rec.red << 8) | rec.red;
-        p.g = (rec.green << 8) | rec.green;
-        p.b = (rec.blue << 8) | rec.blue;
-      }
+    if (ildaStream.header.format != 2) return kept; // palette sections carry no points
+  }
+  return 0;
+}
+
+void ILDAScanner::begin() {
+  offset = 0;
+  frames = 0;
+  error = nullptr;
+  headerFill = 0;
+  skip = 0;
+  terminated = false;
+}
+
+uint8_t ILDAScanner::feed(const uint8_t* data, size_t len) {
+  while (len > 0 && !error) {
+    if (terminated) { offset += len; break; } // anything after the terminator is ignored
+
+    // Skip record data of the current section
+    if (skip > 0) {
+      uint32_t n = min((size_t)skip, len);
+      skip -= n; data += n; len -= n; offset += n;
+      continue;
     }
 
-    pointsRead++;
-    ildaStream.current_record_idx++;
-    ildaStream.next_offset = f.position();
+    // Accumulate the next header
+    size_t n = min(sizeof(ILDA_Header_t) - headerFill, len);
+    memcpy((uint8_t*)&header + headerFill, data, n);
+    headerFill += n; data += n; len -= n; offset += n;
+    if (headerFill < sizeof(ILDA_Header_t)) continue;
+    headerFill = 0;
+
+    if (strncmp(header.ilda, "ILDA", 4) != 0) { error = "Invalid ILDA header"; break; }
+    if (header.format > 5 || bytesPerRecordMap[header.format] == 0) { error = "Unsupported ILDA format"; break; }
+
+    uint16_t records = ntohs(header.records);
+    if (records == 0) { terminated = true; continue; } // terminator header
+
+    if (header.format != 2) frames++;
+    skip = (uint32_t)records * bytesPerRecordMap[header.format];
   }
+  return error ? 1 : 0;
+}
 
-  return pointsRead;
+bool ILDAScanner::complete() {
+  if (error) return false;
+  return terminated || (frames > 0 && headerFill == 0 && skip == 0);
 }
\ No newline at end of file
@@ -3,10 +3,16 @@
 
 #include <Arduino.h>
 #include "FS.h"
+#include <SDReader.h>
+#include "ILDAProjection.h"
+
+#define ILDA_READ_BATCH 64 // records decoded per reader copy
+#define ILDA_MAX_FRAME_POINTS 4096 // frame buffer for frame-based playback, larger frames are decimated
 
 typedef struct {
   int16_t x, y;
   uint16_t r, g, b;
+  uint16_t i; // intensity, DAC_CH_I
 } Point;
 
 typedef struct __attribute__((packed)) {
@@ -25,6 +31,7 @@ typedef struct __attribute__((packed)) {
 typedef struct {
   ILDA_Header_t header; // header of the current file
   File file; // file handle for streaming
+  SDReader* reader; // read-ahead block source
   uint32_t data_offset; // start of record data
   uint32_t next_offset; // next record offset for chunked reading
   uint16_t current_frame_idx; // current frame index
@@ -58,12 +65,41 @@ typedef struct {
   uint8_t format;
 } ILDA_Frame_t;
 
+// Incremental ILDA validator - fed with consecutive file bytes, checks every header
+class ILDAScanner {
+  public:
+    void begin();
+    uint8_t feed(const uint8_t* data, size_t len); // 0 = ok, 1 = invalid data
+    bool complete(); // true once a terminator header or a clean frame boundary was reached
+
+    uint32_t offset = 0; // bytes consumed so far
+    uint32_t frames = 0; // frame headers seen (palette headers excluded)
+    const char* error = nullptr;
+
+  private:
+    ILDA_Header_t header;
+    uint8_t headerFill = 0;
+    uint32_t skip = 0; // record bytes left in the current section
+    bool terminated = false;
+};
+
 class ILDA {
   public:
-    uint8_t readHeader(File file);
+    uint8_t readHeader(File file, SDReader* reader);
     int readILDAChunk(Point* buffer, uint16_t maxPoints);
+    int readILDAFrame(Point* buffer, uint16_t maxPoints);
     
     ILDA_Stream ildaStream;
+    ILDAProjection projection; // 3D stage for formats 0 and 4
+
+  private:
+    uint8_t nextHeader();
+    uint8_t rewind();
+    bool decodeRecord(const uint8_t* temp, Point& p);
+
+    bool projecting = false;
+
+  public:
 
     // uint8_t ilda_palette[256][3] = {
     // { 0, 0, 0 }, // Black/blanked (fixed)
@@ -0,0 +1,69 @@
+#include "ILDAProjection.h"
+
+static uint32_t recipTable[256]; // Q30 of 1/m for m = (256 + i + 0.5) / 512
+
+ILDAProjection::ILDAProjection() {
+  for (uint16_t i = 0; i < 256; i++) recipTable[i] = (1ULL << 40) / (2 * i + 513);
+}
+
+void ILDAProjection::set(const ProjectionParams& params) {
+  portENTER_CRITICAL(&spinlock);
+  pending = params;
+  pending.distance = max<int32_t>(params.distance, 0);
+  changed = true;
+  portEXIT_CRITICAL(&spinlock);
+}
+
+ProjectionParams ILDAProjection::get() {
+  portENTER_CRITICAL(&spinlock);
+  ProjectionParams p = changed ? pending : current;
+  portEXIT_CRITICAL(&spinlock);
+  return p;
+}
+
+bool ILDAProjection::update() {
+  if (!changed) return current.enabled;
+  portENTER_CRITICAL(&spinlock);
+  current = pending;
+  changed = false;
+  portEXIT_CRITICAL(&spinlock);
+
+  // R = Rz * Ry * Rx, computed once per change
+  float a = current.rx * DEG_TO_RAD, b = current.ry * DEG_TO_RAD, c = current.rz * DEG_TO_RAD;
+  float ca = cosf(a), sa = sinf(a), cb = cosf(b), sb = sinf(b), cc = cosf(c), sc = sinf(c);
+  float r[9] = {
+    cc * cb, cc * sb * sa - sc * ca, cc * sb * ca + sc * sa,
+    sc * cb, sc * sb * sa + cc * ca, sc * sb * ca - cc * sa,
+    -sb, cb * sa, cb * ca,
+  };
+  for (uint8_t i = 0; i < 9; i++) m[i] = lroundf(r[i] * 16384);
+  nearPlane = max<int32_t>(current.distance / PROJECTION_NEAR, 1);
+  return current.enabled;
+}
+
+// Normalise depth to m in [0.5, 1), look up 1/m and refine it with r = r * (2 - m * r)
+int32_t ILDAProjection::scale(int32_t depth) {
+  uint8_t lz = __builtin_clz(depth);
+  uint32_t n = (uint32_t)depth << (lz - 1); // m in Q31
+  uint32_t r = recipTable[(n >> 22) & 0xFF];
+  uint32_t e = (1UL << 31) - (uint32_t)(((uint64_t)n * r) >> 31);
+  r = ((uint64_t)r * e) >> 30;
+  return ((uint64_t)current.distance * r) >> (46 - lz);
+}
+
+bool ILDAProjection::project(int16_t& x, int16_t& y, int16_t z) {
+  int32_t px = ((m[0] * x + m[1] * y + m[2] * z) >> 14) + current.tx;
+  int32_t py = ((m[3] * x + m[4] * y + m[5] * z) >> 14) + current.ty;
+  int32_t pz = ((m[6] * x + m[7] * y + m[8] * z) >> 14) + current.tz;
+  bool visible = true;
+  if (current.distance) {
+    int32_t depth = current.distance - pz;
+    if (depth < nearPlane) { depth = nearPlane; visible = false; clipped++; }
+    int32_t s = scale(depth);
+    px = ((int64_t)px * s) >> 16;
+    py = ((int64_t)py * s) >> 16;
+  }
+  x = min<int32_t>(max<int32_t>(px, -32767), 32767);
+  y = min<int32_t>(max<int32_t>(py, -32767), 32767);
+  return visible;
+}
@@ -0,0 +1,41 @@
+#ifndef ILDAPROJECTION_H
+#define ILDAPROJECTION_H
+
+#include <Arduino.h>
+
+#define PROJECTION_DISTANCE 65536 // default camera distance from Z = 0, ILDA units
+#define PROJECTION_NEAR 16 // points closer than distance / PROJECTION_NEAR are blanked
+
+typedef struct {
+  bool enabled;
+  int16_t rx, ry, rz; // [deg] applied X, then Y, then Z
+  int32_t tx, ty, tz; // ILDA units after rotation, +Z towards the viewer
+  int32_t distance; // camera to Z = 0, ILDA units, 0 = orthographic
+} ProjectionParams;
+
+// 3D stage for ILDA formats 0 and 4: rotation, translation and perspective divide in
+// fixed point. The rotation matrix is Q14, the divide uses a reciprocal table refined by
+// one Newton-Raphson step so no point costs a hardware divide. Z = 0 keeps its scale.
+class ILDAProjection {
+  public:
+    ILDAProjection();
+    void set(const ProjectionParams& params);
+    ProjectionParams get();
+    bool update(); // takes over new parameters, true while enabled; call between batches
+    bool project(int16_t& x, int16_t& y, int16_t z); // false = behind the near plane
+
+    uint32_t clipped = 0;
+
+  private:
+    int32_t scale(int32_t depth); // distance / depth in Q16
+
+    ProjectionParams current = { false, 0, 0, 0, 0, 0, 0, PROJECTION_DISTANCE };
+    ProjectionParams pending = current;
+    volatile bool changed = false;
+    portMUX_TYPE spinlock = portMUX_INITIALIZER_UNLOCKED;
+
+    int32_t m[9] = { 16384, 0, 0, 0, 16384, 0, 0, 0, 16384 }; // Q14, row major
+    int32_t nearPlane = PROJECTION_DISTANCE / PROJECTION_NEAR;
+};
+
+#endif /* ILDAPROJECTION_H */
@@ -0,0 +1,97 @@
+#include "IWPFrameCache.h"
+
+void IWPFrameCache::begin() {
+  usePsram = psramFound();
+  budget = usePsram ? IWP_CACHE_BYTES_PSRAM : IWP_CACHE_BYTES_RAM;
+}
+
+IWPCacheEntry* IWPFrameCache::lookup(uint16_t id) {
+  for (uint8_t i = 0; i < IWP_CACHE_ENTRIES; i++) {
+    if (table[i].used && !table[i].stale && table[i].id == id) return &table[i];
+  }
+  return nullptr;
+}
+
+void IWPFrameCache::release(IWPCacheEntry* e) {
+  heap_caps_free(e->points);
+  bytesUsed -= e->count * sizeof(Point);
+  entries--;
+  *e = {};
+}
+
+// Least recently used entry that is not being played
+bool IWPFrameCache::evictOne() {
+  IWPCacheEntry* victim = nullptr;
+  for (uint8_t i = 0; i < IWP_CACHE_ENTRIES; i++) {
+    IWPCacheEntry& e = table[i];
+    if (!e.used || e.pins > 0) continue;
+    if (!victim || e.lastUsed < victim->lastUsed) victim = &e;
+  }
+  if (!victim) return false;
+  release(victim);
+  evictions++;
+  return true;
+}
+
+IWPCacheEntry* IWPFrameCache::store(uint16_t id, uint16_t count) {
+  if (count == 0 || count > IWP_CACHE_MAX_POINTS) return nullptr;
+
+  // Restarted upload of a frame that never completed
+  IWPCacheEntry* e = lookup(id);
+  if (e && e->count == count && e->received < count) {
+    e->received = 0;
+    e->lastUsed = ++clock;
+    return e;
+  }
+  if (e) {
+    if (e->pins > 0) e->stale = true;
+    else release(e);
+  }
+
+  uint32_t size = count * sizeof(Point);
+  if (size > budget) return nullptr;
+  while (bytesUsed + size > budget || entries == IWP_CACHE_ENTRIES) {
+    if (!evictOne()) return nullptr;
+  }
+
+  e = nullptr;
+  for (uint8_t i = 0; i < IWP_CACHE_ENTRIES && !e; i++) if (!table[i].used) e = &table[i];
+  Point* points = (Point*)heap_caps_malloc(size, usePsram ? MALLOC_CAP_SPIRAM : MALLOC_CAP_8BIT);
+  if (!points) return nullptr;
+
+  e->id = id;
+  e->count = count;
+  e->received = 0;
+  e->pins = 0;
+  e->used = true;
+  e->stale = false;
+  e->lastUsed = ++clock;
+  e->points = points;
+  bytesUsed += size;
+  entries++;
+  return e;
+}
+
+IWPCacheEntry* IWPFrameCache::find(uint16_t id) {
+  IWPCacheEntry* e = lookup(id);
+  if (!e || e->received < e->count) { misses++; return nullptr; }
+  e->lastUsed = ++clock;
+  hits++;
+  return e;
+}
+
+void IWPFrameCache::pin(IWPCacheEntry* e) { e->pins++; }
+
+void IWPFrameCache::unpin(IWPCacheEntry* e) {
+  if (e->pins > 0) e->pins--;
+  if (e->pins == 0 && e->stale) release(e);
+}
+
+void IWPFrameCache::clear() {
+  for (uint8_t i = 0; i < IWP_CACHE_ENTRIES; i++) {
+    IWPCacheEntry& e = table[i];
+    if (!e.used) continue;
+    if (e.pins > 0) e.stale = true;
+    else release(&e);
+  }
+}
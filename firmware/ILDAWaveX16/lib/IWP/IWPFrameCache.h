@@ -0,0 +1,51 @@
+#ifndef IWPFRAMECACHE_H
+#define IWPFRAMECACHE_H
+
+#include <Arduino.h>
+#include <ILDA.h>
+
+#define IWP_CACHE_ENTRIES 64
+#define IWP_CACHE_MAX_POINTS 8192 // per frame
+#define IWP_CACHE_BYTES_PSRAM (1024 * 1024)
+#define IWP_CACHE_BYTES_RAM (64 * 1024)
+
+typedef struct {
+  uint16_t id;
+  uint16_t count; // points in the frame
+  uint16_t received; // points stored so far, valid once equal to count
+  uint16_t pins; // playbacks referencing the points
+  bool used;
+  bool stale; // replaced by a newer upload, freed when unpinned
+  uint32_t lastUsed;
+  Point* points;
+} IWPCacheEntry;
+
+// LRU store of sender frames, PSRAM when available. Entries are pinned while played so
+// eviction or a re-upload under the same ID never frees points that are being output.
+class IWPFrameCache {
+  public:
+    void begin();
+    IWPCacheEntry* store(uint16_t id, uint16_t count); // empty entry for an upload
+    IWPCacheEntry* find(uint16_t id); // complete frame or nullptr, counts hits and misses
+    void pin(IWPCacheEntry* e);
+    void unpin(IWPCacheEntry* e);
+    void clear();
+
+    uint32_t budget = 0; // [bytes]
+    uint32_t bytesUsed = 0;
+    uint16_t entries = 0;
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+    uint32_t evictions = 0;
+
+  private:
+    IWPCacheEntry* lookup(uint16_t id);
+    bool evictOne();
+    void release(IWPCacheEntry* e);
+
+    IWPCacheEntry table[IWP_CACHE_ENTRIES] = {};
+    uint32_t clock = 0;
+    bool usePsram = false;
+};
+
+#endif /* IWPFRAMECACHE_H */
@@ -0,0 +1,57 @@
+#include "IWPSerial.h"
+#include "IWPServer.h"
+
+void IWPSerial::begin(Stream& p, IWPServer* s) {
+  port = &p;
+  server = s;
+  xTaskCreatePinnedToCore(task, "IWPSerial", 8192, this, 2, &handle, 0);
+}
+
+void IWPSerial::notify() {
+  if (handle) xTaskNotifyGive(handle);
+}
+
+void IWPSerial::overflow() {
+  overflows++;
+  lost = true;
+  notify();
+}
+
+size_t IWPSerial::write(const uint8_t* msg, size_t len) {
+  return port ? port->write(msg, len) : 0;
+}
+
+void IWPSerial::task(void* pvParameters) {
+  IWPSerial* self = static_cast<IWPSerial*>(pvParameters);
+  while (true) {
+    if (self->lost) { self->resync(); continue; }
+    if (!self->server->waitHeadroom(pdMS_TO_TICKS(IWP_SERIAL_POLL))) continue;
+
+    int avail = self->port->available();
+    size_t n = 0;
+    if (avail > 0) n = self->port->readBytes(&self->buf[self->fill], min<size_t>(avail, sizeof(self->buf) - self->fill));
+    self->fill += n;
+    self->bytesIn += n;
+
+    int used = self->fill ? self->server->receive(self->buf, self->fill, sizeof(self->buf), IWP_SOURCE_SERIAL) : 0;
+    if (used < 0) self->resyncs++;
+    else if (n == 0 && used == 0) ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(IWP_SERIAL_POLL)); // idle or partial record
+  }
+}
+
+// The parse buffer and everything up to the next pause of the host belong to a stream
+// with a hole in it, a byte wise resync could land on a payload 0x00 and clear the buffer
+void IWPSerial::resync() {
+  lost = false;
+  discarded += fill;
+  fill = 0;
+  uint32_t quiet = millis();
+  while (millis() - quiet < IWP_SERIAL_RESYNC_IDLE) {
+    int avail = port->available();
+    if (avail <= 0) { ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(IWP_SERIAL_POLL)); continue; }
+    size_t n = port->readBytes(buf, min<size_t>(avail, sizeof(buf)));
+    bytesIn += n;
+    discarded += n;
+    quiet = millis();
+  }
+}
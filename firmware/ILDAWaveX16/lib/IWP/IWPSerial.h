@@ -0,0 +1,46 @@
+#ifndef IWPSERIAL_H
+#define IWPSERIAL_H
+
+#include <Arduino.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define IWP_SERIAL_CHUNK 4096 // parse buffer, also the largest record accepted
+#define IWP_SERIAL_RX_BUFFER 8192 // driver RX buffer, set before Serial.begin()
+#define IWP_SERIAL_POLL 10 // [ms] wait when no RX event arrives
+#define IWP_SERIAL_RESYNC_IDLE 50 // [ms] line silence that ends the discard after an overflow
+
+class IWPServer;
+
+// IWP records over a wired serial port (USB CDC). A dedicated task reads whole driver
+// buffers and parses them like the TCP stream. While the point buffer is full nothing is
+// read, and HWCDC has no flow control: once its RX buffer is full further bytes are
+// dropped. The host has to pace on status replies (iwp-ilda.py --pace) to avoid that.
+// Records carry no sync marker, so after an overflow the task discards input until the
+// host pauses for IWP_SERIAL_RESYNC_IDLE instead of parsing payload bytes as records.
+// Any Stream works, e.g. a UART for testing.
+class IWPSerial {
+  public:
+    void begin(Stream& port, IWPServer* server);
+    void notify(); // data arrived, call from the driver's RX event
+    void overflow(); // the driver dropped bytes, call from its RX overflow event
+    size_t write(const uint8_t* buf, size_t len);
+
+    uint32_t bytesIn = 0;
+    uint32_t resyncs = 0; // unknown record types skipped
+    uint32_t overflows = 0; // driver RX overflows, each ends in a discard until the line is idle
+    uint32_t discarded = 0; // bytes thrown away while resyncing after an overflow
+
+  private:
+    static void task(void* pvParameters);
+    void resync();
+
+    Stream* port = nullptr;
+    IWPServer* server = nullptr;
+    TaskHandle_t handle = nullptr;
+    uint8_t buf[IWP_SERIAL_CHUNK];
+    uint16_t fill = 0;
+    volatile bool lost = false; // set by overflow(), cleared when the task starts a resync
+};
+
+#endif /* IWPSERIAL_H */
@@ -1,71 +1,424 @@
 #include "IWPServer.h"
 
 void IWPServer::begin() {
+  lock = xSemaphoreCreateMutex();
+  cache.begin();
   udp.begin(IW_UDP_PORT);
   Serial.printf("IWP UDP Port: %i\n", IW_UDP_PORT);
-  udpOpen = 1;
+  stream.begin();
 }
 
 void IWPServer::stop() {
   udp.stop();
-  udpOpen = 0;
+  stream.drop();
 }
 
 void IWPServer::setRendererHandle(Renderer* renderer) { rendererPtr = renderer; }
 
+// Drain everything queued since the last wakeup
 void IWPServer::loop() {
-  if (udpOpen == 0 || udp.parsePacket() == 0) return;
+  int len;
+  xSemaphoreTake(lock, portMAX_DELAY);
+  while ((len = udp.receive(netRxBuffer, sizeof(netRxBuffer))) >= 0) {
+    if (len > 0) handlePacket(len);
+    udp.processed();
+  }
+  processStream();
+  playCached();
+
+  if (statusMode == IW_STATUS_PERIODIC && millis() - lastStatus >= statusInterval) {
+    if (statusSource == IWP_SOURCE_UDP) sendStatus(IWP_SOURCE_UDP, &statusTarget);
+    else sendStatus(statusSource, nullptr);
+    lastStatus = millis();
+  }
+  xSemaphoreGive(lock);
+}
+
+uint32_t IWPServer::nextTimeout(uint32_t timeout) {
+  if (playing.entry || stream.connected()) timeout = min(timeout, (uint32_t)2);
+  if (statusMode != IW_STATUS_PERIODIC) return timeout;
+  uint32_t elapsed = millis() - lastStatus;
+  return elapsed >= statusInterval ? 0 : min(timeout, statusInterval - elapsed);
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+void IWPServer::handlePacket(int len) {
+  handleRecords(netRxBuffer, len, IWP_SOURCE_UDP);
+}
+
+// Parses buffered stream bytes, an incomplete record is kept at the start of buf.
+// Returns the bytes used, -1 when framing was lost and bytes were skipped.
+int IWPServer::parseStream(uint8_t* buf, uint16_t& fill, uint16_t size, uint8_t src) {
+  int used = handleRecords(buf, fill, src);
+  bool lost = badRecord || (used == 0 && fill == size); // unknown type or an oversized record
+  int skip = badRecord ? used + 1 : (lost ? fill : used);
+  fill -= skip;
+  memmove(buf, &buf[skip], fill);
+  return lost ? -1 : used;
+}
+
+int IWPServer::receive(uint8_t* buf, uint16_t& fill, uint16_t size, uint8_t src) {
+  xSemaphoreTake(lock, portMAX_DELAY);
+  int used = parseStream(buf, fill, size, src);
+  xSemaphoreGive(lock);
+  return used;
+}
+
+bool IWPServer::waitHeadroom(TickType_t wait) {
+  return rendererPtr->buffer_wait_space(SOURCE_IWP, IWP_STREAM_HEADROOM, wait);
+}
+
+// Records are acknowledged to the TCP sender once parsed, a full point buffer leaves
+// them unparsed so the window closes and the sender blocks
+void IWPServer::processStream() {
+  if (stream.overflowed()) { stream.drop(); return; }
+  if (stream.generation != streamGeneration) {
+    streamGeneration = stream.generation;
+    streamFill = 0;
+    stores[IWP_SOURCE_TCP] = {};
+    if (statusSource == IWP_SOURCE_TCP) statusMode = IW_STATUS_OFF;
+  }
+  while (rendererPtr->buffer_capacity(SOURCE_IWP) - 1 - rendererPtr->buffer_fill(SOURCE_IWP) >= IWP_STREAM_HEADROOM) {
+    size_t n = stream.read(&streamBuf[streamFill], sizeof(streamBuf) - streamFill);
+    streamFill += n;
+    if (streamFill == 0) return;
+
+    int used = parseStream(streamBuf, streamFill, sizeof(streamBuf), IWP_SOURCE_TCP);
+    if (used < 0) {
+      streamErrors++;
+      streamFill = 0;
+      stream.drop();
+      return;
+    }
+    stream.consumed(used);
+    if (n == 0 && used == 0) return;
+  }
+}
+
+void IWPServer::reply(uint8_t source, const struct sockaddr_in* to, const uint8_t* msg, size_t len) {
+  if (source == IWP_SOURCE_TCP) stream.write(msg, len);
+  else if (source == IWP_SOURCE_SERIAL) serial.write(msg, len);
+  else if (to) udp.sendTo(*to, msg, len);
+  else udp.reply(msg, len);
+}
+
+void IWPServer::sendStatus(uint8_t source, const struct sockaddr_in* to) {
+  uint8_t msg[17];
+  uint16_t fill = rendererPtr->buffer_fill(SOURCE_IWP);
+  uint16_t space = rendererPtr->buffer_capacity(SOURCE_IWP) - 1 - fill;
+  msg[0] = IW_TYPE_STATUS;
+  msg[1] = fill >> 8;
+  msg[2] = fill;
+  msg[3] = space >> 8;
+  msg[4] = space;
+  put32(&msg[5], rendererPtr->point_rate);
+  put32(&msg[9], rendererPtr->buffer_underruns(SOURCE_IWP));
+  put32(&msg[13], rendererPtr->buffer_dropped(SOURCE_IWP));
+  reply(source, to, msg, sizeof(msg));
+  statusSent++;
+}
+
+void IWPServer::flush(Point* points, int& count) {
+  if (count > 0) {
+    decoded += count;
+    if (store->active) storePoints(points, count);
+    else {
+      if (playing.entry) stopCached(); // live points take over the output
+      if (source != IWP_SOURCE_UDP) {
+        // Runs can expand past the headroom checked before parsing, wait instead of dropping
+        uint32_t start = ESP.getCycleCount();
+        rendererPtr->buffer_wait_space(SOURCE_IWP, count, pdMS_TO_TICKS(IWP_STREAM_WAIT));
+        waitCycles += ESP.getCycleCount() - start;
+      }
+      rendererPtr->recorder.add(SOURCE_IWP, points + recorded, count - recorded);
+      rendererPtr->buffer_add_points(SOURCE_IWP, points, count);
+    }
+  }
+  count = 0;
+  recorded = 0;
+}
+
+// Parts of a frame are taken in order only, a gap leaves it incomplete until re-sent
+void IWPServer::storePoints(const Point* points, int count) {
+  IWPCacheEntry* e = store->entry;
+  if (e && store->offset == e->received) {
+    uint16_t n = min<int>(count, e->count - e->received);
+    memcpy(&e->points[e->received], points, n * sizeof(Point));
+    e->received += n;
+  }
+  store->offset += count;
+}
+
+void IWPServer::play(uint16_t id, uint16_t repeat) {
+  IWPCacheEntry* e = cache.find(id);
+  if (!e) {
+    uint8_t msg[3] = { IW_TYPE_MISS, (uint8_t)(id >> 8), (uint8_t)id };
+    reply(source, nullptr, msg, sizeof(msg));
+    return;
+  }
+  if (playCount == IWP_PLAY_QUEUE) return;
+  cache.pin(e);
+  playQueue[(playHead + playCount++) % IWP_PLAY_QUEUE] = { e, repeat };
+  if (!playing.entry) nextCached();
+}
+
+void IWPServer::nextCached() {
+  if (playing.entry) cache.unpin(playing.entry);
+  playing = {};
+  playPos = 0;
+  if (playCount == 0) return;
+  playing = playQueue[playHead];
+  playHead = (playHead + 1) % IWP_PLAY_QUEUE;
+  playCount--;
+}
 
-  int len = udp.read(netRxBuffer, sizeof(netRxBuffer));
-  if (len == 0) return;
+void IWPServer::stopCached() {
+  while (playing.entry) nextCached();
+}
+
+// Refill from the current cached frame, switching only at frame boundaries
+void IWPServer::playCached() {
+  uint32_t low = (uint64_t)rendererPtr->point_rate * IWP_PLAY_LEAD / 1000000;
+  while (playing.entry && rendererPtr->buffer_fill(SOURCE_IWP) < low) {
+    IWPCacheEntry* e = playing.entry;
+    if (playPos >= e->count) {
+      playPos = 0;
+      if (playing.repeat == 1 || (playing.repeat == 0 && playCount > 0)) { nextCached(); continue; }
+      if (playing.repeat > 1) playing.repeat--;
+    }
+    uint16_t n = min<uint16_t>(e->count - playPos, IWP_BUFFER_SIZE);
+    rendererPtr->recorder.add(SOURCE_IWP, &e->points[playPos], n);
+    if (playPos + n >= e->count) rendererPtr->recorder.mark(SOURCE_IWP); // one pass is one frame
+    rendererPtr->buffer_add_points(SOURCE_IWP, &e->points[playPos], n);
+    playPos += n;
+  }
+}
+
+// Zigzag LEB128, 3 bytes cover any 16b difference
+static inline bool readDelta(const uint8_t*& p, const uint8_t* end, int32_t& v) {
+  uint32_t u = 0;
+  for (uint8_t shift = 0; shift < 21 && p < end; shift += 7) {
+    uint8_t b = *p++;
+    u |= (uint32_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) {
+      v = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+void IWPServer::decodeRun(const uint8_t* p, const uint8_t* end, uint16_t x, uint16_t y, Point* points, int& count) {
+  Point cur = { (int16_t)x, (int16_t)y, 0, 0, 0, 0 };
+  uint16_t r = 0, g = 0, b = 0;
+  bool started = false;
 
-  Point points[512];
+  while (p < end) {
+    uint8_t op = *p & IW_OP_MASK;
+    uint8_t n = (*p++ & IW_OP_COUNT) + 1;
+
+    if (op == IW_OP_COLOR) {
+      if (p + 3 > end) return;
+      r = p[0] * 257;
+      g = p[1] * 257;
+      b = p[2] * 257;
+      p += 3;
+      continue;
+    }
+    if (op == IW_OP_DWELL) {
+      if (!started) return;
+      for (uint8_t i = 0; i < n; i++) {
+        points[count++] = cur;
+        if (count == IWP_BUFFER_SIZE) flush(points, count);
+      }
+      continue;
+    }
+
+    bool blank = op == IW_OP_BLANK;
+    for (uint8_t i = 0; i < n; i++) {
+      int32_t dx, dy;
+      if (!readDelta(p, end, dx) || !readDelta(p, end, dy)) return;
+      cur.x = (uint16_t)(cur.x + dx);
+      cur.y = (uint16_t)(cur.y + dy);
+      cur.r = blank ? 0 : r;
+      cur.g = blank ? 0 : g;
+      cur.b = blank ? 0 : b;
+      points[count++] = cur;
+      if (count == IWP_BUFFER_SIZE) flush(points, count);
+    }
+    started = true;
+  }
+}
+
+// Parses complete records and returns the bytes used, stopping at an unknown record type.
+// The TYPE 7 target ends at the next non-point record, on UDP also with the datagram.
+int IWPServer::handleRecords(const uint8_t* buf, int len, uint8_t src) {
+  uint32_t start = ESP.getCycleCount();
+  Point points[IWP_BUFFER_SIZE];
   int pointCount = 0;
-  
+  bool replyOnce = false;
+  source = src;
+  store = &stores[src];
+  decoded = 0;
+  waitCycles = 0;
+  badRecord = false;
+
   int offset = 0;
   while (offset < len) {
-    
-    if (netRxBuffer[offset] == IW_TYPE_0) {
+    uint8_t type = buf[offset];
+    if (type != IW_TYPE_2 && type != IW_TYPE_3 && type != IW_TYPE_6) {
+      if (store->active) flush(points, pointCount);
+      store->active = false;
+    }
+    else if (src != IWP_SOURCE_UDP && rendererPtr->buffer_capacity(SOURCE_IWP) - 1 - rendererPtr->buffer_fill(SOURCE_IWP) < pointCount + IWP_STREAM_HEADROOM) break;
+
+    if (type == IW_TYPE_0) {
+      // Frame marker for recording, the points before it are still queued after the clear
+      if (!store->active) rendererPtr->recorder.add(SOURCE_IWP, points + recorded, pointCount - recorded);
+      rendererPtr->recorder.mark(SOURCE_IWP);
+      recorded = pointCount;
       Point p = {0};
-      if (pointCount < IWP_BUFFER_SIZE) points[pointCount++] = p;
-      rendererPtr->buffer_clear_points();
+      points[pointCount++] = p;
+      if (pointCount == IWP_BUFFER_SIZE) flush(points, pointCount);
+      stopCached();
+      rendererPtr->buffer_clear_points(SOURCE_IWP);
       offset++;
     }
-    else if (netRxBuffer[offset] == IW_TYPE_1) {
+    else if (type == IW_TYPE_1) {
       if (offset + 5 > len) break;
-      uint32_t value = ((uint32_t)netRxBuffer[offset + 1] << 24) |
-        ((uint32_t)netRxBuffer[offset + 2] << 16) |
-        ((uint32_t)netRxBuffer[offset + 3] << 8) |
-        ((uint32_t)netRxBuffer[offset + 4]);
+      uint32_t value = ((uint32_t)buf[offset + 1] << 24) |
+        ((uint32_t)buf[offset + 2] << 16) |
+        ((uint32_t)buf[offset + 3] << 8) |
+        ((uint32_t)buf[offset + 4]);
       rendererPtr->change_freq(value);
       offset += 5;
     }
-    else if (netRxBuffer[offset] == IW_TYPE_2) {
+    else if (type == IW_TYPE_4) {
+      if (offset + 5 > len) break;
+      uint32_t value = ((uint32_t)buf[offset + 1] << 24) |
+        ((uint32_t)buf[offset + 2] << 16) |
+        ((uint32_t)buf[offset + 3] << 8) |
+        ((uint32_t)buf[offset + 4]);
+      rendererPtr->change_rate(value);
+      offset += 5;
+    }
+    else if (type == IW_TYPE_5) {
+      if (offset + 4 > len) break;
+      uint8_t mode = buf[offset + 1];
+      uint16_t interval = (buf[offset + 2] << 8) | buf[offset + 3];
+      if (mode == IW_STATUS_ONCE) replyOnce = true;
+      else {
+        statusMode = mode <= IW_STATUS_PERIODIC ? mode : IW_STATUS_OFF;
+        statusInterval = max(interval, (uint16_t)IWP_STATUS_MIN_INTERVAL);
+        statusSource = src;
+        if (src == IWP_SOURCE_UDP) statusTarget = udp.remote();
+      }
+      offset += 4;
+    }
+    else if (type == IW_TYPE_7) {
+      if (offset + 7 > len) break;
+      flush(points, pointCount);
+      uint16_t id = (buf[offset + 1] << 8) | buf[offset + 2];
+      uint16_t count = (buf[offset + 3] << 8) | buf[offset + 4];
+      IWPCacheEntry*& e = store->entry;
+      store->offset = (buf[offset + 5] << 8) | buf[offset + 6];
+      // The first part (re)starts the upload, later parts continue the one in progress
+      if (store->offset == 0) e = cache.store(id, count);
+      else if (e && !(e->used && !e->stale && e->id == id && e->count == count)) e = nullptr;
+      store->active = true;
+      offset += 7;
+    }
+    else if (type == IW_TYPE_8) {
+      if (offset + 5 > len) break;
+      flush(points, pointCount);
+      play((buf[offset + 1] << 8) | buf[offset + 2], (buf[offset + 3] << 8) | buf[offset + 4]);
+      offset += 5;
+    }
+    else if (type == IW_TYPE_9) {
+      if (offset + 11 > len) break;
+      PatternParams p;
+      p.type = buf[offset + 1];
+      p.size = buf[offset + 2];
+      p.points = (buf[offset + 3] << 8) | buf[offset + 4];
+      p.fa = buf[offset + 5];
+      p.fb = buf[offset + 6];
+      p.phase = buf[offset + 7];
+      p.r = buf[offset + 8];
+      p.g = buf[offset + 9];
+      p.b = buf[offset + 10];
+      rendererPtr->generator.set(p);
+      offset += 11;
+    }
+    else if (type == IW_TYPE_10) {
+      if (offset + 4 > len) break;
+      int16_t scroll = (buf[offset + 1] << 8) | buf[offset + 2];
+      uint8_t length = buf[offset + 3];
+      if (offset + 4 + length > len) break;
+      char text[TEXT_MAX + 1];
+      uint8_t n = min<uint8_t>(length, TEXT_MAX);
+      memcpy(text, &buf[offset + 4], n);
+      text[n] = 0;
+      rendererPtr->generator.text.set(text, scroll);
+      offset += 4 + length;
+    }
+    else if (type == IW_TYPE_6) {
+      if (offset + 7 > len) break;
+      uint16_t length = (buf[offset + 1] << 8) | buf[offset + 2];
+      uint16_t x = (buf[offset + 3] << 8) | buf[offset + 4];
+      uint16_t y = (buf[offset + 5] << 8) | buf[offset + 6];
+      if (offset + 7 + length > len) break;
+      decodeRun(&buf[offset + 7], &buf[offset + 7 + length], x, y, points, pointCount);
+      offset += 7 + length;
+    }
+    else if (type == IW_TYPE_2) {
       if (offset + 8 > len) break;
       Point p = {0};
-      p.x = (netRxBuffer[offset + 1] << 8) | netRxBuffer[offset + 2];
-      p.y = (netRxBuffer[offset + 3] << 8) | netRxBuffer[offset + 4];
-      p.r = netRxBuffer[offset + 5];
-      p.g = netRxBuffer[offset + 6];
-      p.b = netRxBuffer[offset + 7]; 
+      p.x = (buf[offset + 1] << 8) | buf[offset + 2];
+      p.y = (buf[offset + 3] << 8) | buf[offset + 4];
+      p.r = buf[offset + 5];
+      p.g = buf[offset + 6];
+      p.b = buf[offset + 7]; 
       p.r = map(p.r, 0, 0xFF, 0, 0xFFFF);
       p.g = map(p.g, 0, 0xFF, 0, 0xFFFF);
       p.b = map(p.b, 0, 0xFF, 0, 0xFFFF);
-      if (pointCount < IWP_BUFFER_SIZE) points[pointCount++] = p;
+      points[pointCount++] = p;
+      if (pointCount == IWP_BUFFER_SIZE) flush(points, pointCount);
       offset += 8;
     }
-    else if (netRxBuffer[offset] == IW_TYPE_3) {
+    else if (type == IW_TYPE_3) {
       if (offset + 11 > len) break;
       Point p = {0};
-      p.x = (netRxBuffer[offset + 1] << 8) | netRxBuffer[offset + 2];
-      p.y = (netRxBuffer[offset + 3] << 8) | netRxBuffer[offset + 4];
-      p.r = (netRxBuffer[offset + 5] << 8) | netRxBuffer[offset + 6];
-      p.g = (netRxBuffer[offset + 7] << 8) | netRxBuffer[offset + 8];
-      p.b = (netRxBuffer[offset + 9] << 8) | netRxBuffer[offset + 10];
-      if (pointCount < IWP_BUFFER_SIZE) points[pointCount++] = p;
+      p.x = (buf[offset + 1] << 8) | buf[offset + 2];
+      p.y = (buf[offset + 3] << 8) | buf[offset + 4];
+      p.r = (buf[offset + 5] << 8) | buf[offset + 6];
+      p.g = (buf[offset + 7] << 8) | buf[offset + 8];
+      p.b = (buf[offset + 9] << 8) | buf[offset + 10];
+      points[pointCount++] = p;
+      if (pointCount == IWP_BUFFER_SIZE) flush(points, pointCount);
       offset += 11;
     }
-    else break;
+    else {
+      badRecord = true;
+      break;
+    }
+  }
+  flush(points, pointCount);
+  if (src == IWP_SOURCE_UDP) store->active = false;
+
+  // Reported after the points were queued, so FILL already includes them
+  bool target = statusSource == src && (src != IWP_SOURCE_UDP || (udp.remoteIP() == statusTarget.sin_addr.s_addr && udp.remotePort() == ntohs(statusTarget.sin_port)));
+  if (replyOnce || (statusMode == IW_STATUS_PACKET && target && offset > 0)) sendStatus(src, nullptr);
+
+  IWPPathStats& st = pathStats[src];
+  if (decoded > 0) {
+    st.points += decoded;
+    st.cycles += ((float)(ESP.getCycleCount() - start - waitCycles) / decoded - st.cycles) / 16;
   }
-   if (pointCount > 0) rendererPtr->buffer_add_points(points, pointCount);
+  return offset;
 }
\ No newline at end of file
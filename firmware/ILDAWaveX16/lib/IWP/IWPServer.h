@@ -2,17 +2,56 @@
 #define IWPSERVER_H
 
 #include <Arduino.h>
-#include <WiFiUdp.h>
+#include <UDPSocket.h>
 #include <Renderer.h>
+#include "IWPFrameCache.h"
+#include "IWPStream.h"
+#include "IWPSerial.h"
 
 #define IW_UDP_PORT 7200
 
-#define IWP_BUFFER_SIZE 1024
+#define IWP_BUFFER_SIZE 256 // points decoded per batch
+
+#define IWP_STATUS_MIN_INTERVAL 5 // [ms]
+#define IWP_PLAY_QUEUE 8 // cached frame play requests
+#define IWP_PLAY_LEAD 20000 // [us] points kept queued while playing cached frames
+#define IWP_STREAM_CHUNK 4096 // TCP parse buffer, also the largest record accepted
+#define IWP_STREAM_HEADROOM 1024 // [points] free buffer space needed to parse TCP/serial records
+#define IWP_STREAM_WAIT 20 // [ms] longest wait for buffer space per point batch of a TCP/serial run,
+                           // stalls the network task shared with IDN; at low point rates points beyond it are dropped
+
+enum IWPSource : uint8_t { IWP_SOURCE_UDP, IWP_SOURCE_TCP, IWP_SOURCE_SERIAL, IWP_SOURCE_COUNT };
+
+typedef struct {
+  uint32_t points;
+  float cycles; // CPU cycles per point, parse and queueing
+} IWPPathStats;
 
 #define IW_TYPE_0 0x00 // Turn off
 #define IW_TYPE_1 0x01 // Period
 #define IW_TYPE_2 0x02 // 16b X/Y + 8b R/G/B
 #define IW_TYPE_3 0x03 // 16b X/Y + 16b R/G/B
+#define IW_TYPE_4 0x04 // Point rate
+#define IW_TYPE_5 0x05 // Status request
+#define IW_TYPE_6 0x06 // Delta coded point run
+#define IW_TYPE_7 0x07 // Store frame in cache
+#define IW_TYPE_8 0x08 // Play cached frame
+#define IW_TYPE_9 0x09 // Pattern generator
+#define IW_TYPE_10 0x0A // Pattern generator text
+#define IW_TYPE_MISS 0x88 // Cache miss reply, device to sender
+#define IW_TYPE_STATUS 0x85 // Status reply, device to sender
+
+#define IW_STATUS_OFF 0x00 // stop replies
+#define IW_STATUS_ONCE 0x01 // reply to this packet
+#define IW_STATUS_PACKET 0x02 // reply after every packet
+#define IW_STATUS_PERIODIC 0x03 // reply every INTERVAL ms
+
+#define IW_OP_DELTA 0x00 // N points at the current color: DX, DY each
+#define IW_OP_COLOR 0x40 // set the current color: R, G, B
+#define IW_OP_BLANK 0x80 // N blanked moves: DX, DY each
+#define IW_OP_DWELL 0xC0 // repeat the previous point N times
+#define IW_OP_MASK 0xC0
+#define IW_OP_COUNT 0x3F // N - 1
 
 // TYPE 0 - Turn off
 //  0
@@ -38,18 +77,152 @@
 // | 0x03 |      X      |      Y      |      R      |      G      |      B      |
 // +------+------+------+------+------+------+------+------+------+------+------+
 
+// TYPE 4 - 32b Point rate [pps]
+//  0     1      2      3      4
+// +------+------+------+------+------+
+// | 0x04 |            RATE           |
+// +------+------+------+------+------+
+
+// TYPE 5 - Status request, replies go to the requesting address and port
+//  0     1      2      3
+// +------+------+------+------+
+// | 0x05 | MODE |   INTERVAL  |
+// +------+------+------+------+
+
+// Status reply
+//  0     1      2      3      4      5      6      7      8
+// +------+------+------+------+------+------+------+------+------+
+// | 0x85 |     FILL    |     FREE    |           RATE            |
+// +------+------+------+------+------+------+------+------+------+
+//  9     10     11     12     13     14     15     16
+// +------+------+------+------+------+------+------+------+
+// |         UNDERRUNS         |          DROPPED          |
+// +------+------+------+------+------+------+------+------+
+// FILL/FREE in points, RATE in pps, counters since boot
+
+// TYPE 6 - Delta coded point run, LENGTH octets of ops follow the header
+//  0     1      2      3      4      5      6      7
+// +------+------+------+------+------+------+------+------ - -
+// | 0x06 |    LENGTH   |      X      |      Y      |  OPS ...
+// +------+------+------+------+------+------+------+------ - -
+// X/Y is the start position, not a point. Each op is one byte OOCCCCCC, N = C + 1:
+//   DELTA  00  N x (DX, DY)   points at the current color
+//   COLOR  01  R, G, B        8b color for following DELTA points, 0 at record start
+//   BLANK  10  N x (DX, DY)   blanked moves, the current color is kept
+//   DWELL  11  -              previous point repeated N times
+// DX/DY are zigzag LEB128 varints relative to the previous point, coordinates wrap at 16b
+
+// TYPE 7 - Store frame, the point records directly following it go to frame ID
+//  0     1      2      3      4      5      6
+// +------+------+------+------+------+------+------+
+// | 0x07 |      ID     |    COUNT    |   OFFSET    |
+// +------+------+------+------+------+------+------+
+// COUNT points in total, this part starting at OFFSET. Parts are accepted in order only,
+// a frame can be played once all COUNT points arrived. Any other record or the end of the
+// datagram ends the part.
+
+// TYPE 8 - Play cached frame
+//  0     1      2      3      4
+// +------+------+------+------+------+
+// | 0x08 |      ID     |    REPEAT   |
+// +------+------+------+------+------+
+// Queued behind earlier requests. REPEAT 0 loops until the next request, live points or
+// TYPE 0 stop playback.
+
+// TYPE 9 - Pattern generator, PatternParams of the Renderer
+//  0     1      2      3      4      5      6      7      8      9      10
+// +------+------+------+------+------+------+------+------+------+------+------+
+// | 0x09 | TYPE | SIZE |    POINTS   |  FA  |  FB  | PHASE|   R  |   G  |   B  |
+// +------+------+------+------+------+------+------+------+------+------+------+
+// TYPE 0 off, 1 test, 2 circle, 3 Lissajous, 4 grid, 5 scanner, 6 sweep, 7 text. SIZE in %
+// of the scan range, POINTS per cycle. The change is taken over at the end of the running cycle.
+
+// TYPE 10 - Pattern generator text, shown with TYPE 9 pattern 7
+//  0     1      2      3      4
+// +------+------+------+------+------ - -
+// | 0x0A |    SCROLL   |LENGTH|  TEXT ...
+// +------+------+------+------+------ - -
+// SCROLL is a signed step per cycle, 1/32768 of half the scan range, 0 centres the text.
+// LENGTH octets of ASCII follow, at most TEXT_MAX are kept.
+
+// Cache miss reply, the sender should store the frame again
+//  0     1      2
+// +------+------+------+
+// | 0x88 |      ID     |
+// +------+------+------+
+
+// TCP port IW_TCP_PORT carries the same records back to back, replies come back on the
+// connection. Data is acknowledged as it is queued for output, so the sender is paced by
+// the TCP window and nothing is dropped. An unknown record type closes the connection.
+// A serial port (USB CDC) works the same way, an unknown record type skips one byte.
+
 class IWPServer {
   public:
     void begin();
     void stop();
     void setRendererHandle(Renderer* renderer);
-    void loop();
+    void loop(); // drains all pending datagrams, call after UDPSocket::wait()
+    uint32_t nextTimeout(uint32_t timeout); // [ms] wait() timeout honouring periodic status
+    int receive(uint8_t* buf, uint16_t& fill, uint16_t size, uint8_t src); // stream bytes from another task
+    bool waitHeadroom(TickType_t wait);
     uint16_t iw_period = 1; // [ms]
+    UDPSocket udp;
+    uint8_t statusMode = IW_STATUS_OFF;
+    uint16_t statusInterval = 0; // [ms]
+    uint32_t statusSent = 0;
+    IWPFrameCache cache;
+    IWPStream stream;
+    IWPSerial serial;
+    IWPPathStats pathStats[IWP_SOURCE_COUNT] = {};
+    uint32_t streamErrors = 0; // connections closed for unparseable data
   private:
-    WiFiUDP udp;
-    uint8_t udpOpen;
+    void handlePacket(int len);
+    int handleRecords(const uint8_t* buf, int len, uint8_t src);
+    int parseStream(uint8_t* buf, uint16_t& fill, uint16_t size, uint8_t src);
+    void processStream();
+    void reply(uint8_t source, const struct sockaddr_in* to, const uint8_t* msg, size_t len);
+    void sendStatus(uint8_t source, const struct sockaddr_in* to);
+    void flush(Point* points, int& count);
+    void decodeRun(const uint8_t* p, const uint8_t* end, uint16_t x, uint16_t y, Point* points, int& count);
+    void storePoints(const Point* points, int count);
+    void play(uint16_t id, uint16_t repeat);
+    void playCached();
+    void nextCached();
+    void stopCached();
+
+    typedef struct {
+      IWPCacheEntry* entry; // TYPE 7 target
+      bool active;
+      uint16_t offset;
+    } StoreState;
+    StoreState stores[IWP_SOURCE_COUNT] = {};
+    StoreState* store = &stores[IWP_SOURCE_UDP];
+    uint8_t source = IWP_SOURCE_UDP; // origin of the records being parsed
+    uint32_t decoded = 0;
+    int recorded = 0; // points of the pending batch already passed to the recorder
+    uint32_t waitCycles = 0;
+    bool badRecord = false; // handleRecords() stopped at an unknown type
+    SemaphoreHandle_t lock = nullptr; // parsing from the network and serial tasks
+
+    typedef struct {
+      IWPCacheEntry* entry;
+      uint16_t repeat; // 0 = until the next request
+    } PlayRequest;
+    PlayRequest playQueue[IWP_PLAY_QUEUE];
+    uint8_t playHead = 0;
+    uint8_t playCount = 0;
+    PlayRequest playing = {};
+    uint16_t playPos = 0;
+
+    struct sockaddr_in statusTarget = {};
+    uint8_t statusSource = IWP_SOURCE_UDP;
+    uint32_t lastStatus = 0; // [ms]
+
     Renderer* rendererPtr = nullptr;
     uint8_t netRxBuffer[1500];
+    uint8_t streamBuf[IWP_STREAM_CHUNK];
+    uint16_t streamFill = 0;
+    uint32_t streamGeneration = 0;
 };
 
 #endif /* IWPSERVER_H */
\ No newline at end of file
@@ -0,0 +1,84 @@
+#include "IWPStream.h"
+
+void IWPStream::begin() {
+  lock = xSemaphoreCreateRecursiveMutex(); // drop() closes under it, AsyncTCP calls onDisconnect from close()
+  rx = xStreamBufferCreate(IWP_STREAM_BUFFER, 1);
+  server = new AsyncServer(IW_TCP_PORT);
+  server->setNoDelay(true);
+  server->onClient(onClient, this);
+  server->begin();
+  Serial.printf("IWP TCP Port: %i\n", IW_TCP_PORT);
+}
+
+void IWPStream::onClient(void* arg, AsyncClient* c) {
+  IWPStream* self = static_cast<IWPStream*>(arg);
+  xSemaphoreTakeRecursive(self->lock, portMAX_DELAY);
+  bool busy = self->client != nullptr;
+  if (!busy) {
+    xStreamBufferReset(self->rx);
+    self->overflow = false;
+    self->client = c;
+    self->generation++;
+    self->connections++;
+  }
+  xSemaphoreGiveRecursive(self->lock);
+  if (busy) {
+    self->rejected++;
+    c->onDisconnect([](void*, AsyncClient* rejected) { delete rejected; }, nullptr);
+    c->close(true);
+    return;
+  }
+
+  c->setNoDelay(true);
+  c->onData(onData, self);
+  c->onDisconnect(onDisconnect, self);
+}
+
+void IWPStream::onData(void* arg, AsyncClient* c, void* data, size_t len) {
+  IWPStream* self = static_cast<IWPStream*>(arg);
+  c->ackLater(); // acknowledged from consumed()
+  if (self->overflow) return; // stream is broken, waiting for the network task to drop it
+  // Closing here would run onDisconnect and delete c inside its own recv callback
+  if (xStreamBufferSend(self->rx, data, len, 0) != len) {
+    self->overflows++;
+    self->overflow = true;
+    return;
+  }
+  self->bytesIn += len;
+}
+
+void IWPStream::onDisconnect(void* arg, AsyncClient* c) {
+  IWPStream* self = static_cast<IWPStream*>(arg);
+  xSemaphoreTakeRecursive(self->lock, portMAX_DELAY);
+  if (self->client == c) self->client = nullptr;
+  xSemaphoreGiveRecursive(self->lock);
+  delete c;
+}
+
+size_t IWPStream::read(uint8_t* dst, size_t max) {
+  if (!rx || max == 0) return 0;
+  return xStreamBufferReceive(rx, dst, max, 0);
+}
+
+bool IWPStream::pending() { return rx && xStreamBufferBytesAvailable(rx) > 0; }
+
+void IWPStream::consumed(size_t len) {
+  if (len == 0) return;
+  xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+  if (client) client->ack(len);
+  xSemaphoreGiveRecursive(lock);
+}
+
+size_t IWPStream::write(const uint8_t* buf, size_t len) {
+  size_t sent = 0;
+  xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+  if (client && client->space() >= len) sent = client->write((const char*)buf, len);
+  xSemaphoreGiveRecursive(lock);
+  return sent;
+}
+
+void IWPStream::drop() {
+  xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+  if (client) client->close(true);
+  xSemaphoreGiveRecursive(lock);
+}
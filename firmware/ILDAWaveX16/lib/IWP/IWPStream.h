@@ -0,0 +1,46 @@
+#ifndef IWPSTREAM_H
+#define IWPSTREAM_H
+
+#include <Arduino.h>
+#include <AsyncTCP.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/stream_buffer.h"
+
+#define IW_TCP_PORT 7201
+#define IWP_STREAM_BUFFER 16384 // larger than the TCP receive window
+
+// IWP over TCP, one client at a time. Received data is acknowledged only once the records
+// have been queued for output, so the TCP window follows the point buffer and a fast
+// sender is paced instead of losing points. AsyncTCP callbacks only copy into a stream
+// buffer; records are parsed by the network task like UDP datagrams.
+class IWPStream {
+  public:
+    void begin();
+    size_t read(uint8_t* dst, size_t max); // network task
+    void consumed(size_t len); // opens the window by len bytes
+    size_t write(const uint8_t* buf, size_t len); // replies to the client
+    void drop(); // protocol error, close the client
+    bool connected() const { return client != nullptr; }
+    bool overflowed() const { return overflow; } // the network task drops the client, never onData
+    bool pending();
+
+    uint32_t generation = 0; // bumped per connection, restarts parsing
+    uint32_t connections = 0;
+    uint32_t rejected = 0; // second client while one is connected
+    uint32_t bytesIn = 0;
+    uint32_t overflows = 0; // data beyond the window, the client is dropped
+
+  private:
+    static void onClient(void* arg, AsyncClient* c);
+    static void onData(void* arg, AsyncClient* c, void* data, size_t len);
+    static void onDisconnect(void* arg, AsyncClient* c);
+
+    AsyncServer* server = nullptr;
+    AsyncClient* volatile client = nullptr;
+    SemaphoreHandle_t lock = nullptr; // recursive, guards client against the disconnect callback
+    StreamBufferHandle_t rx = nullptr;
+    volatile bool overflow = false; // set by onData, cleared for the next client
+};
+
+#endif /* IWPSTREAM_H */
@@ -0,0 +1,184 @@
+#include "FrameOptimizer.h"
+
+static inline uint32_t distance(const Point& a, const Point& b) {
+  return max(abs((int32_t)(uint16_t)a.x - (uint16_t)b.x), abs((int32_t)(uint16_t)a.y - (uint16_t)b.y)); // the slower axis sets the move time
+}
+
+static inline bool lit(const Point& p) { return p.r | p.g | p.b; }
+
+// Buffers exist only while enabled: 68 KB in RAM, or 592 KB in PSRAM with its larger cache
+void FrameOptimizer::update() {
+  if (!enabled) {
+    if (scratch) release();
+    allocFailed = false;
+  }
+  else if (!scratch && !allocFailed) allocFailed = !allocate(); // retried on the next enable
+}
+
+bool FrameOptimizer::allocate() {
+  uint32_t caps = psramFound() ? MALLOC_CAP_SPIRAM : MALLOC_CAP_8BIT;
+  slotCount = psramFound() ? OPT_CACHE_FRAMES_PSRAM : OPT_CACHE_FRAMES_RAM;
+  arenaSize = psramFound() ? OPT_CACHE_ENTRIES_PSRAM : OPT_CACHE_ENTRIES_RAM;
+  scratch = (Point*)heap_caps_malloc(ILDA_MAX_FRAME_POINTS * sizeof(Point), caps);
+  slots = (uint32_t*)heap_caps_malloc(slotCount * sizeof(uint32_t), caps);
+  arena = (uint16_t*)heap_caps_malloc(arenaSize * sizeof(uint16_t), caps);
+  if (!slots || !arena) {
+    heap_caps_free(slots);
+    heap_caps_free(arena);
+    slots = nullptr;
+    arena = nullptr;
+    slotCount = arenaSize = 0; // optimize every loop, uncached
+  }
+  resetRequested = true;
+  return scratch != nullptr;
+}
+
+void FrameOptimizer::release() {
+  heap_caps_free(scratch);
+  heap_caps_free(slots);
+  heap_caps_free(arena);
+  scratch = nullptr;
+  slots = nullptr;
+  arena = nullptr;
+  slotCount = arenaSize = 0;
+}
+
+// Lit runs of the frame, returns the segment count, 0 when there are too many
+uint16_t FrameOptimizer::split(const Point* frame, uint16_t n) {
+  uint16_t count = 0;
+  for (uint16_t i = 0; i < n; i++) {
+    if (!lit(frame[i])) continue;
+    if (count == OPT_MAX_SEGMENTS) return 0;
+    segStart[count] = i;
+    while (i + 1 < n && lit(frame[i + 1])) i++;
+    segEnd[count++] = i;
+  }
+  return count;
+}
+
+// Blanked travel of the current order, closing back to the first segment
+uint32_t FrameOptimizer::travel(const Point* frame, uint16_t count) const {
+  uint32_t sum = 0;
+  for (uint16_t k = 0; k < count; k++) sum += distance(frame[tail(k)], frame[head(k + 1 == count ? 0 : k + 1)]);
+  return sum;
+}
+
+// Start with the first segment, then always take the closest free end
+void FrameOptimizer::greedy(const Point* frame, uint16_t count) {
+  static bool used[OPT_MAX_SEGMENTS];
+  memset(used, 0, count);
+  used[0] = true;
+  order[0] = 0;
+  for (uint16_t k = 1; k < count; k++) {
+    const Point& pen = frame[tail(k - 1)];
+    uint32_t best = UINT32_MAX;
+    uint16_t pick = 0;
+    for (uint16_t s = 0; s < count; s++) {
+      if (used[s]) continue;
+      uint32_t d = distance(pen, frame[segStart[s]]);
+      if (d < best) { best = d; pick = s; }
+      d = distance(pen, frame[segEnd[s]]);
+      if (d < best) { best = d; pick = s | REVERSED; }
+    }
+    used[pick & ~REVERSED] = true;
+    order[k] = pick;
+  }
+}
+
+// Reversing positions i..j replaces the moves into i and out of j, the segments in
+// between swap their ends. The first segment stays in place, the frame is a loop.
+void FrameOptimizer::twoOpt(const Point* frame, uint16_t count) {
+  for (uint8_t pass = 0; pass < OPT_2OPT_PASSES; pass++) {
+    bool improved = false;
+    for (uint16_t i = 1; i < count; i++) {
+      for (uint16_t j = i; j < count; j++) {
+        uint16_t next = j + 1 == count ? 0 : j + 1;
+        const Point& a = frame[tail(i - 1)];
+        const Point& d = frame[head(next)];
+        uint32_t before = distance(a, frame[head(i)]) + distance(frame[tail(j)], d);
+        uint32_t after = distance(a, frame[tail(j)]) + distance(frame[head(i)], d);
+        if (after >= before) continue;
+        for (uint16_t lo = i, hi = j; lo <= hi; lo++, hi--) {
+          uint16_t t = order[lo] ^ REVERSED;
+          order[lo] = order[hi] ^ REVERSED;
+          order[hi] = t;
+        }
+        improved = true;
+      }
+    }
+    if (!improved) break;
+  }
+}
+
+// Segments in the new order, each reached by a regenerated blanked move that dwells at
+// both ends. Returns the point count, 0 if it would not fit.
+uint16_t FrameOptimizer::build(const Point* frame, uint16_t count) {
+  uint32_t out = 0;
+  const Point* pen = &frame[tail(count - 1)];
+  for (uint16_t k = 0; k < count; k++) {
+    const Point& to = frame[head(k)];
+    uint32_t moves = OPT_BLANK_MIN + distance(*pen, to) / OPT_BLANK_STEP;
+    uint16_t s = order[k] & ~REVERSED;
+    if (out + moves + segEnd[s] - segStart[s] + 1 > ILDA_MAX_FRAME_POINTS) return 0;
+    int32_t x0 = (uint16_t)pen->x, y0 = (uint16_t)pen->y;
+    int32_t dx = (int32_t)(uint16_t)to.x - x0, dy = (int32_t)(uint16_t)to.y - y0;
+    for (uint32_t m = 0; m < moves; m++) {
+      scratch[out++] = { (int16_t)(x0 + dx * (int32_t)m / (int32_t)(moves - 1)), (int16_t)(y0 + dy * (int32_t)m / (int32_t)(moves - 1)), 0, 0, 0, 0 };
+    }
+    if (order[k] & REVERSED) for (int32_t i = segEnd[s]; i >= segStart[s]; i--) scratch[out++] = frame[i];
+    else for (uint16_t i = segStart[s]; i <= segEnd[s]; i++) scratch[out++] = frame[i];
+    pen = &frame[tail(k)];
+  }
+  return out;
+}
+
+bool FrameOptimizer::store(uint16_t index, uint16_t count) {
+  if (index >= slotCount || arenaUsed + count + 1 > arenaSize) return false;
+  arena[arenaUsed] = count;
+  memcpy(&arena[arenaUsed + 1], order, count * sizeof(uint16_t));
+  slots[index] = arenaUsed;
+  arenaUsed += count + 1;
+  return true;
+}
+
+const Point* FrameOptimizer::process(const Point* frame, uint16_t& n, uint16_t index) {
+  if (!enabled || !scratch || n == 0) return frame;
+  if (resetRequested) {
+    resetRequested = false;
+    for (uint32_t i = 0; i < slotCount; i++) slots[i] = NOT_CACHED;
+    arenaUsed = 0;
+  }
+
+  uint16_t count = split(frame, n);
+  uint32_t slot = index < slotCount ? slots[index] : NOT_CACHED;
+  if (slot == AS_AUTHORED) { cacheHits++; return frame; }
+  if (slot != NOT_CACHED && arena[slot] == count) {
+    // Same segmentation as when it was cached, otherwise the geometry changed and it is redone
+    memcpy(order, &arena[slot + 1], count * sizeof(uint16_t));
+    uint16_t built = build(frame, count);
+    if (built) { cacheHits++; n = built; return scratch; }
+  }
+
+  if (count < 2) {
+    if (index < slotCount) slots[index] = AS_AUTHORED;
+    return frame;
+  }
+  for (uint16_t k = 0; k < count; k++) order[k] = k;
+  uint32_t original = travel(frame, count);
+  greedy(frame, count);
+  if (count <= OPT_2OPT_SEGMENTS) twoOpt(frame, count);
+  uint32_t optimized = travel(frame, count);
+  uint16_t built = build(frame, count);
+
+  frames++;
+  if (built == 0 || built >= n) {
+    if (index < slotCount) slots[index] = AS_AUTHORED;
+    return frame;
+  }
+  travelBefore += original;
+  travelAfter += optimized;
+  pointsSaved += n - built;
+  store(index, count);
+  n = built;
+  return scratch;
+}
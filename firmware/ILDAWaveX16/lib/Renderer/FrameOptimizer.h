@@ -0,0 +1,61 @@
+#pragma once
+#include <Arduino.h>
+#include <ILDA.h>
+
+#define OPT_MAX_SEGMENTS 1024 // lit runs per frame, busier frames are played as authored
+#define OPT_2OPT_SEGMENTS 256 // 2-opt only up to this many segments, greedy order above
+#define OPT_2OPT_PASSES 4
+#define OPT_BLANK_MIN 4 // blanked points per move, settling at both ends
+#define OPT_BLANK_STEP 2048 // [DAC codes] travelled per additional blanked point
+#define OPT_CACHE_FRAMES_PSRAM 8192
+#define OPT_CACHE_FRAMES_RAM 1024
+#define OPT_CACHE_ENTRIES_PSRAM 262144 // segment order words, 512 KB
+#define OPT_CACHE_ENTRIES_RAM 8192 // 16 KB
+
+// Reorders the lit segments of an ILDA frame to cut blanked travel: greedy nearest
+// neighbour with reversal, then 2-opt. Blanked points of the file are dropped and each
+// move is regenerated with points proportional to its length. The order is cached per
+// frame index, so a file is optimized during its first loop only. Frames that would not
+// get shorter are kept as authored.
+class FrameOptimizer {
+public:
+    void update(); // SD task, allocates after enabled is set and frees after it is cleared
+    void reset() { resetRequested = true; } // new file or changed geometry, any task
+    const Point* process(const Point* frame, uint16_t& n, uint16_t index); // SD task
+
+    bool enabled = false; // set from any task, takes effect at the next update()
+    uint32_t frames = 0; // frames run through the optimizer, cache hits not counted
+    uint32_t cacheHits = 0;
+    uint64_t travelBefore = 0; // [DAC codes] blanked travel of the frames that got shorter
+    uint64_t travelAfter = 0;
+    uint32_t pointsSaved = 0;
+
+private:
+    static const uint32_t NOT_CACHED = 0xFFFFFFFF;
+    static const uint32_t AS_AUTHORED = 0xFFFFFFFE;
+    static const uint16_t REVERSED = 0x8000;
+
+    bool allocate();
+    void release();
+    uint16_t split(const Point* frame, uint16_t n);
+    uint16_t head(uint16_t k) const { return order[k] & REVERSED ? segEnd[order[k] & ~REVERSED] : segStart[order[k]]; }
+    uint16_t tail(uint16_t k) const { return order[k] & REVERSED ? segStart[order[k] & ~REVERSED] : segEnd[order[k]]; }
+    uint32_t travel(const Point* frame, uint16_t count) const;
+    void greedy(const Point* frame, uint16_t count);
+    void twoOpt(const Point* frame, uint16_t count);
+    uint16_t build(const Point* frame, uint16_t count);
+    bool store(uint16_t index, uint16_t count);
+
+    volatile bool resetRequested = true;
+    bool allocFailed = false;
+    Point* scratch = nullptr; // optimized frame
+    uint32_t* slots = nullptr; // arena offset per frame index
+    uint16_t* arena = nullptr; // count, then the order of each cached frame
+    uint32_t slotCount = 0;
+    uint32_t arenaSize = 0;
+    uint32_t arenaUsed = 0;
+
+    uint16_t segStart[OPT_MAX_SEGMENTS];
+    uint16_t segEnd[OPT_MAX_SEGMENTS];
+    uint16_t order[OPT_MAX_SEGMENTS]; // segment index | REVERSED
+};
@@ -0,0 +1,180 @@
+#include "PatternGenerator.h"
+
+static int16_t sineTable[257]; // one period, the extra entry saves a wrap in the interpolation
+
+static inline int32_t sin15(uint16_t t) {
+  int32_t a = sineTable[t >> 8], b = sineTable[(t >> 8) + 1];
+  return a + (((b - a) * (int32_t)(t & 0xFF)) >> 8);
+}
+
+static inline int32_t cos15(uint16_t t) { return sin15(t + 16384); }
+
+PatternGenerator::PatternGenerator() {
+  for (uint16_t i = 0; i <= 256; i++) sineTable[i] = lroundf(32767.0f * sinf(i * 2.0f * PI / 256));
+}
+
+const char* PatternGenerator::name(uint8_t type) {
+  static const char* names[PATTERN_COUNT] = { "off", "test", "circle", "lissajous", "grid", "scanner", "sweep", "text" };
+  return type < PATTERN_COUNT ? names[type] : "off";
+}
+
+void PatternGenerator::set(const PatternParams& params) {
+  portENTER_CRITICAL(&spinlock);
+  pending = params;
+  pending.type = min<uint8_t>(params.type, PATTERN_COUNT - 1);
+  pending.size = min<uint8_t>(params.size, 100);
+  pending.points = max<uint16_t>(params.points, GEN_MIN_POINTS);
+  pending.fa = min<uint8_t>(max<uint8_t>(params.fa, 1), GEN_MAX_LINES);
+  pending.fb = min<uint8_t>(max<uint8_t>(params.fb, 1), GEN_MAX_LINES);
+  changed = true;
+  portEXIT_CRITICAL(&spinlock);
+}
+
+PatternParams PatternGenerator::get() {
+  portENTER_CRITICAL(&spinlock);
+  PatternParams p = changed ? pending : current;
+  portEXIT_CRITICAL(&spinlock);
+  return p;
+}
+
+// Q15 to DAC codes. Y is inverted like the ILDA and IDN decoders do, positive y is up
+static constexpr uint16_t dacX(int32_t x, int32_t scale) { return 0x8000 + ((x * scale) >> 15); }
+static constexpr uint16_t dacY(int32_t y, int32_t scale) { return 0x8000 - ((y * scale) >> 15); }
+static_assert(dacY(16384, 32767) < 0x8000 && dacY(-16384, 32767) > 0x8000, "positive y must give a DAC code below 0x8000");
+static_assert(dacX(16384, 32767) > 0x8000, "positive x must give a DAC code above 0x8000");
+
+Point PatternGenerator::output(int32_t x, int32_t y, bool lit) {
+  Point p = { (int16_t)dacX(x, scale), (int16_t)dacY(y, scale), 0, 0, 0, 0 };
+  if (lit) {
+    p.r = red;
+    p.g = green;
+    p.b = blue;
+  }
+  return p;
+}
+
+// Lit segment, preceded by a blanked move when it does not continue the previous one
+void PatternGenerator::line(int16_t x0, int16_t y0, int16_t x1, int16_t y1) {
+  if (segments + 3 > GEN_MAX_SEGMENTS) return; // room for the closing move
+  int16_t px = segments ? path[segments - 1].x1 : x0, py = segments ? path[segments - 1].y1 : y0;
+  if (px != x0 || py != y0) path[segments++] = { px, py, x0, y0, GEN_BLANK_POINTS, false };
+  path[segments++] = { x0, y0, x1, y1, 0, true };
+}
+
+void PatternGenerator::textLine(void* ctx, int16_t x0, int16_t y0, int16_t x1, int16_t y1) {
+  static_cast<PatternGenerator*>(ctx)->line(x0, y0, x1, y1);
+}
+
+void PatternGenerator::buildPath() {
+  const int16_t F = 32767;
+  segments = 0;
+  if (current.type == PATTERN_TEST) {
+    line(-F, -F, F, -F); line(F, -F, F, F); line(F, F, -F, F); line(-F, F, -F, -F);
+    line(-F, 0, F, 0);
+    line(0, -F, 0, F);
+    for (uint8_t i = 0; i < 32; i++) {
+      uint16_t a = i * 2048, b = (i + 1) * 2048;
+      line(cos15(a) / 2, sin15(a) / 2, cos15(b) / 2, sin15(b) / 2);
+    }
+  }
+  else if (current.type == PATTERN_GRID) {
+    // Alternate directions so each line starts near where the previous one ended
+    for (uint8_t i = 0; i < current.fa; i++) {
+      int16_t x = current.fa == 1 ? 0 : -F + (int32_t)2 * F * i / (current.fa - 1);
+      if (i & 1) line(x, F, x, -F); else line(x, -F, x, F);
+    }
+    for (uint8_t i = 0; i < current.fb; i++) {
+      int16_t y = current.fb == 1 ? 0 : F - (int32_t)2 * F * i / (current.fb - 1);
+      if (i & 1) line(F, y, -F, y); else line(-F, y, F, y);
+    }
+  }
+  else if (current.type == PATTERN_SCANNER) {
+    for (uint8_t i = 0; i < current.fb; i++) {
+      int16_t y = current.fb == 1 ? 0 : F - (int32_t)2 * F * i / (current.fb - 1);
+      if (i & 1) line(F, y, -F, y); else line(-F, y, F, y);
+    }
+  }
+  else if (current.type == PATTERN_TEXT) {
+    text.frame(textLine, this);
+    if (!segments) path[segments++] = { 0, 0, 0, 0, current.points, false }; // blank frame keeps the scroll timing
+  }
+
+  // Blanked move from the end of the path back to its start
+  if (segments) {
+    Segment last = path[segments - 1];
+    if (last.x1 != path[0].x0 || last.y1 != path[0].y0) path[segments++] = { last.x1, last.y1, path[0].x0, path[0].y0, GEN_BLANK_POINTS, false };
+  }
+
+  // Lit points by segment length, what the blanked moves leave of the cycle
+  uint32_t blank = 0, total = 0;
+  for (uint8_t i = 0; i < segments; i++) {
+    Segment& s = path[i];
+    if (!s.lit) { blank += s.points; continue; }
+    total += max(abs(s.x1 - s.x0), abs(s.y1 - s.y0));
+  }
+  uint32_t budget = current.points > blank ? current.points - blank : 0;
+  cycleLength = 0;
+  for (uint8_t i = 0; i < segments; i++) {
+    Segment& s = path[i];
+    if (s.lit) s.points = max<uint32_t>(total ? (uint64_t)budget * max(abs(s.x1 - s.x0), abs(s.y1 - s.y0)) / total : 0, 2);
+    cycleLength += s.points;
+  }
+}
+
+// Called at a cycle boundary only, so a running pattern is never cut
+void PatternGenerator::adopt() {
+  portENTER_CRITICAL(&spinlock);
+  current = pending;
+  changed = false;
+  portEXIT_CRITICAL(&spinlock);
+
+  scale = (int32_t)current.size * 32767 / 100;
+  red = current.r * 257;
+  green = current.g * 257;
+  blue = current.b * 257;
+  phase = 0;
+  seg = 0;
+  segPos = 0;
+  if (current.type == PATTERN_TEST || current.type == PATTERN_GRID || current.type == PATTERN_SCANNER || current.type == PATTERN_TEXT) buildPath();
+  else {
+    segments = 0;
+    cycleLength = current.points;
+    step = (uint32_t)(((uint64_t)1 << 32) / current.points);
+  }
+}
+
+Point PatternGenerator::next() {
+  if (segments) {
+    const Segment& s = path[seg];
+    int32_t x = s.x0 + (int64_t)(s.x1 - s.x0) * segPos / s.points;
+    int32_t y = s.y0 + (int64_t)(s.y1 - s.y0) * segPos / s.points;
+    if (++segPos >= s.points) {
+      segPos = 0;
+      if (++seg >= segments) seg = 0;
+    }
+    return output(x, y, s.lit);
+  }
+
+  uint16_t t = phase >> 16;
+  phase += step;
+  switch (current.type) {
+    case PATTERN_CIRCLE: return output(cos15(t), sin15(t), true);
+    case PATTERN_LISSAJOUS: return output(sin15(current.fa * t), sin15(current.fb * t + (current.phase << 8)), true);
+    default: return output(sin15(t), 0, true); // PATTERN_SWEEP, sine turns are easy on the galvos
+  }
+}
+
+uint16_t PatternGenerator::fill(Point* out, uint16_t max) {
+  uint16_t n = 0;
+  while (n < max) {
+    if (index == 0 && (changed || cycleLength == 0 || current.type == PATTERN_TEXT)) adopt();
+    if (current.type == PATTERN_OFF || cycleLength == 0) break;
+    out[n++] = next();
+    if (++index >= cycleLength) {
+      index = 0;
+      phase = 0;
+      cycles++;
+    }
+  }
+  return n;
+}
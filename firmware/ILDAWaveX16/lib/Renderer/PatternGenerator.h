@@ -0,0 +1,69 @@
+#pragma once
+#include <Arduino.h>
+#include <ILDA.h>
+#include "VectorText.h"
+
+#define GEN_MAX_SEGMENTS 192 // path patterns, blanked moves included
+#define GEN_BLANK_POINTS 8 // blanked move between two lit path segments
+#define GEN_MIN_POINTS 32 // per cycle
+#define GEN_MAX_LINES 16 // grid columns/rows, scanner lines
+
+enum PatternType : uint8_t { PATTERN_OFF, PATTERN_TEST, PATTERN_CIRCLE, PATTERN_LISSAJOUS, PATTERN_GRID, PATTERN_SCANNER, PATTERN_SWEEP, PATTERN_TEXT, PATTERN_COUNT };
+
+typedef struct {
+  uint8_t type;
+  uint8_t size; // [%] of the full scan range
+  uint16_t points; // per cycle
+  uint8_t fa, fb; // Lissajous X/Y frequency, grid columns/rows, scanner lines (fb)
+  uint8_t phase; // Lissajous Y phase, 256 = one period
+  uint8_t r, g, b;
+} PatternParams;
+
+// Test patterns computed on the device, Q15 fixed point with an interpolated sine table.
+// Parametric patterns (circle, Lissajous, sweep) evaluate one phase step per point, line
+// patterns (test, grid, scanner) are built once per change as a path of segments with
+// points distributed by length. Text is rebuilt every cycle to scroll. New parameters are
+// taken over at the end of a cycle.
+class PatternGenerator {
+public:
+    PatternGenerator();
+    void set(const PatternParams& params);
+    PatternParams get();
+    bool enabled() { return current.type != PATTERN_OFF || changed; }
+    uint16_t fill(Point* out, uint16_t max); // next points of the running pattern
+    static const char* name(uint8_t type);
+
+    VectorText text;
+    uint32_t cycles = 0;
+
+private:
+    typedef struct {
+        int16_t x0, y0, x1, y1; // Q15
+        uint16_t points;
+        bool lit;
+    } Segment;
+
+    void adopt();
+    void line(int16_t x0, int16_t y0, int16_t x1, int16_t y1);
+    static void textLine(void* ctx, int16_t x0, int16_t y0, int16_t x1, int16_t y1);
+    void buildPath();
+    Point next();
+    Point output(int32_t x, int32_t y, bool lit); // Q15 to DAC codes
+
+    PatternParams current = { PATTERN_OFF, 50, 1000, 3, 2, 64, 255, 255, 255 };
+    PatternParams pending = current;
+    volatile bool changed = false;
+    portMUX_TYPE spinlock = portMUX_INITIALIZER_UNLOCKED;
+
+    uint32_t index = 0; // point in the current cycle
+    uint32_t cycleLength = 0; // sum of segment points, can exceed the requested points
+    uint32_t phase = 0; // parametric position in the cycle, Q16.16 of 65536
+    uint32_t step = 0;
+    int32_t scale = 0; // size in Q15
+    uint16_t red = 0, green = 0, blue = 0;
+
+    Segment path[GEN_MAX_SEGMENTS];
+    uint8_t segments = 0;
+    uint8_t seg = 0;
+    uint16_t segPos = 0;
+};
@@ -0,0 +1,88 @@
+#include "PointResampler.h"
+
+void PointResampler::reset() {
+    phase = 0;
+    primed = false;
+    haveTimestamp = false;
+    sampleAcc = timeAcc = 0;
+    inputRate = 0;
+    bypass = true;
+}
+
+// Rate = samples / elapsed sender time, exponentially averaged over roughly 16 chunks
+void PointResampler::addTimestamp(uint32_t timestamp, uint16_t samples) {
+    if (haveTimestamp) {
+        uint32_t dt = timestamp - lastTimestamp;
+        if (dt == 0 || dt > 1000000) { reset(); } // sender restarted or paused
+        else {
+            sampleAcc += (lastSamples - sampleAcc) / 16;
+            timeAcc += (dt - timeAcc) / 16;
+            if (timeAcc > 0) inputRate = sampleAcc * 1000000.0f / timeAcc;
+            updateStep();
+        }
+    }
+    lastTimestamp = timestamp;
+    lastSamples = samples;
+    haveTimestamp = true;
+}
+
+void PointResampler::setOutputRate(uint32_t pps) {
+    if (pps == outputRate) return;
+    outputRate = pps;
+    updateStep();
+}
+
+void PointResampler::setInputRate(float pps) {
+    haveTimestamp = false;
+    inputRate = pps;
+    updateStep();
+}
+
+void PointResampler::updateStep() {
+    if (inputRate <= 0 || outputRate == 0) { bypass = true; return; }
+    float ratio = inputRate / outputRate;
+    ratio = constrain(ratio, 1.0f / RESAMPLER_MAX_RATIO, 1.0f / RESAMPLER_MIN_RATIO);
+    bypass = fabsf(ratio - 1.0f) * 1000000.0f < RESAMPLER_BYPASS_PPM;
+    step = (uint32_t)(ratio * 65536.0f);
+}
+
+static inline int16_t lerp16(int16_t a, int16_t b, uint32_t t) {
+    int32_t ua = (uint16_t)a, ub = (uint16_t)b; // coordinates are unsigned DAC codes
+    return (int16_t)(uint16_t)(ua + (((ub - ua) * (int32_t)(t >> 1)) >> 15));
+}
+
+// Convert as much of `in` as fits into `out`; `consumed` reports the input samples used
+uint16_t PointResampler::process(const Point* in, uint16_t n, uint16_t& consumed, Point* out, uint16_t maxOut) {
+    uint16_t produced = 0;
+    consumed = 0;
+
+    if (bypass) {
+        uint16_t count = min(n, maxOut);
+        memcpy(out, in, count * sizeof(Point));
+        consumed = count;
+        if (count > 0) { prev = in[count - 1]; primed = true; phase = 0; }
+        return count;
+    }
+
+    if (!primed && n > 0) { prev = in[consumed++]; primed = true; phase = 0; }
+
+    while (consumed < n) {
+        const Point& cur = in[consumed];
+        while (phase < 65536) {
+            if (produced >= maxOut) return produced;
+            Point& p = out[produced++];
+            p.x = lerp16(prev.x, cur.x, phase);
+            p.y = lerp16(prev.y, cur.y, phase);
+            const Point& c = phase < 32768 ? prev : cur;
+            p.r = c.r;
+            p.g = c.g;
+            p.b = c.b;
+            p.i = c.i;
+            phase += step;
+        }
+        phase -= 65536;
+        prev = cur;
+        consumed++;
+    }
+    return produced;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <Arduino.h>
+#include <ILDA.h>
+
+#define RESAMPLER_MIN_RATIO 0.25f // output/input limits bound the work per input point
+#define RESAMPLER_MAX_RATIO 4.0f
+#define RESAMPLER_BYPASS_PPM 2000 // rates closer than this are passed through untouched
+
+// Streaming point-rate converter: linear interpolation for X/Y, nearest sample for colors
+// so blanking edges stay crisp. The input rate is estimated from sender timestamps.
+class PointResampler {
+public:
+    void reset();
+    void addTimestamp(uint32_t timestamp, uint16_t samples); // [us] sender clock of a chunk's first sample
+    void setOutputRate(uint32_t pps);
+    void setInputRate(float pps); // known rate, e.g. from a frame duration
+    uint16_t process(const Point* in, uint16_t n, uint16_t& consumed, Point* out, uint16_t maxOut);
+
+    float inputRate = 0; // estimated sender rate [pps]
+    uint32_t outputRate = 0;
+    bool bypass = true;
+
+private:
+    void updateStep();
+
+    uint32_t step = 65536; // input samples per output point, Q16
+    uint32_t phase = 0; // position between prev and the next input sample, Q16
+    Point prev = {};
+    bool primed = false;
+    uint32_t lastTimestamp = 0;
+    uint16_t lastSamples = 0;
+    bool haveTimestamp = false;
+    float sampleAcc = 0;
+    float timeAcc = 0;
+};
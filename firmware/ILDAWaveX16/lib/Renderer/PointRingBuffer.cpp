@@ -1,51 +1,154 @@
 #include "PointRingBuffer.h"
 
+// PSRAM when present, the consumer reads at most a few MB/s
+bool PointRingBuffer::begin(size_t capacity) {
+    if (buffer) return true;
+    size_t size = 1;
+    while (size * 2 <= capacity) size *= 2;
+    buffer = (Point*)heap_caps_malloc(size * sizeof(Point), MALLOC_CAP_SPIRAM);
+    if (!buffer) buffer = (Point*)heap_caps_malloc(size * sizeof(Point), MALLOC_CAP_8BIT);
+    if (!buffer) return false;
+    mask = size - 1;
+    head = tail = 0;
+    return true;
+}
+
+size_t PointRingBuffer::freeSpace() {
+    return mask + 1 - ((head - tail) & mask);
+}
+
 bool PointRingBuffer::canItFit(uint16_t count) {
     taskENTER_CRITICAL(&spinlock);
-    uint16_t free_space;
-    if (head >= tail) free_space = POINT_BUFFER_SIZE - (head - tail);
-    else free_space = tail - head;
+    size_t free_space = freeSpace();
     taskEXIT_CRITICAL(&spinlock);
     return count < free_space;
 }
 
+// Block the calling task until the consumer has freed enough space, no polling
+bool PointRingBuffer::waitForSpace(uint16_t count, TickType_t wait) {
+    taskENTER_CRITICAL(&spinlock);
+    bool fits = count < freeSpace();
+    if (!fits) {
+        spaceWaiter = xTaskGetCurrentTaskHandle();
+        spaceWanted = count;
+    }
+    taskEXIT_CRITICAL(&spinlock);
+    if (fits) return true;
+    ulTaskNotifyTake(pdTRUE, wait);
+    return canItFit(count);
+}
+
+// Copies in short locked runs, a consumer on the other core spins on the lock meanwhile
 bool PointRingBuffer::addPoints(const Point* points, uint16_t num) {
     bool success = true;
-    taskENTER_CRITICAL(&spinlock);
-    for (uint16_t i = 0; i < num; i++) {
-        size_t next = (head + 1) % POINT_BUFFER_SIZE;
-        if (next == tail) { 
-            success = false;
-            break; // buffer full
+    uint16_t i = 0;
+    while (success && i < num) {
+        uint16_t end = min<uint16_t>(num, i + POINT_BUFFER_LOCKED_COPY);
+        taskENTER_CRITICAL(&spinlock);
+        for (; i < end; i++) {
+            size_t next = (head + 1) & mask;
+            if (next == tail) {
+                success = false;
+                dropped += num - i;
+                break; // buffer full
+            }
+            buffer[head] = points[i];
+            head = next;
         }
-        buffer[head] = points[i];
-        head = next;
+        taskEXIT_CRITICAL(&spinlock);
     }
-    taskEXIT_CRITICAL(&spinlock);
     return success;
 }
 
 bool PointRingBuffer::addPoint(const Point& p) { return addPoints(&p, 1); }
 
+// Producers decode straight into the buffer; the span stays free until commit, so the
+// consumer never sees it half written
+uint16_t PointRingBuffer::reserve(Point*& dst, uint16_t max) {
+    taskENTER_CRITICAL(&spinlock);
+    size_t space = min(freeSpace() - 1, mask + 1 - head);
+    dst = &buffer[head];
+    taskEXIT_CRITICAL(&spinlock);
+    return min(space, (size_t)max);
+}
+
+// Fails if another producer moved head since reserve, the span is then discarded
+bool PointRingBuffer::commit(const Point* dst, uint16_t num) {
+    bool success = false;
+    taskENTER_CRITICAL(&spinlock);
+    if (dst == &buffer[head] && num < freeSpace()) {
+        head = (head + num) & mask;
+        success = true;
+    }
+    taskEXIT_CRITICAL(&spinlock);
+    return success;
+}
+
+void PointRingBuffer::discard(uint16_t num) {
+    taskENTER_CRITICAL(&spinlock);
+    dropped += num;
+    taskEXIT_CRITICAL(&spinlock);
+}
+
 bool PointRingBuffer::getPoint(Point& p) {
     if (head == tail) return false;
     taskENTER_CRITICAL(&spinlock);
     p = buffer[tail];
-    tail = (tail + 1) % POINT_BUFFER_SIZE;
+    tail = (tail + 1) & mask;
     taskEXIT_CRITICAL(&spinlock);
     return true;
 }
 
-uint16_t PointRingBuffer::getPoints(Point* points, uint16_t max) {
-    uint16_t count = 0;
+bool PointRingBuffer::peek(Point& p) {
     taskENTER_CRITICAL(&spinlock);
-    while (count < max && tail != head) {
-        points[count] = buffer[tail];
-        tail = (tail + 1) % POINT_BUFFER_SIZE;
+    bool any = head != tail;
+    if (any) p = buffer[tail];
+    taskEXIT_CRITICAL(&spinlock);
+    return any;
+}
+
+// untilBlank stops after the first blanked point, the mixer switches sources there.
+// Single consumer: producers never write between tail and head, so the PSRAM copy runs
+// outside the critical section and only the tail update is inside it
+uint16_t PointRingBuffer::getPoints(Point* points, uint16_t max, bool untilBlank) {
+    taskENTER_CRITICAL(&spinlock);
+    size_t from = tail;
+    size_t available = (head - from) & mask;
+    uint32_t generation = clears;
+    taskEXIT_CRITICAL(&spinlock);
+
+    uint16_t count = 0;
+    while (count < max && count < available) {
+        Point& p = points[count] = buffer[(from + count) & mask];
         count++;
+        if (untilBlank && (p.r | p.g | p.b) == 0) break;
+    }
+
+    TaskHandle_t wake = nullptr;
+    taskENTER_CRITICAL(&spinlock);
+    if (generation != clears) count = 0; // cleared during the copy, producers may have reused the span
+    else tail = (from + count) & mask;
+    if (count == 0 && !drained) underruns++;
+    drained = count == 0;
+    if (spaceWaiter && spaceWanted < freeSpace()) {
+        wake = spaceWaiter;
+        spaceWaiter = nullptr;
     }
     taskEXIT_CRITICAL(&spinlock);
+    if (wake) xTaskNotifyGive(wake);
     return count;
 }
 
-void PointRingBuffer::clear() { head = tail = 0; }
\ No newline at end of file
+void PointRingBuffer::clear() {
+    taskENTER_CRITICAL(&spinlock);
+    head = tail = 0;
+    clears++;
+    taskEXIT_CRITICAL(&spinlock);
+}
+
+uint16_t PointRingBuffer::size() {
+    taskENTER_CRITICAL(&spinlock);
+    size_t used = mask + 1 - freeSpace();
+    taskEXIT_CRITICAL(&spinlock);
+    return used;
+}
\ No newline at end of file
@@ -2,20 +2,38 @@
 #include <Arduino.h>
 #include <ILDA.h>
 
-#define POINT_BUFFER_SIZE 8192
+#define POINT_BUFFER_SIZE 8192 // default capacity, a power of two
+#define POINT_BUFFER_LOCKED_COPY 32 // [points] most addPoints() copies per critical section
 
 class PointRingBuffer {
 public:
+    bool begin(size_t capacity = POINT_BUFFER_SIZE); // capacity is rounded down to a power of two
+    size_t capacity() const { return mask + 1; }
     bool canItFit(uint16_t count);
+    bool waitForSpace(uint16_t count, TickType_t wait);
     bool addPoints(const Point* points, uint16_t num);
     bool addPoint(const Point& p);
+    uint16_t reserve(Point*& dst, uint16_t max); // contiguous free span at head, filled in place
+    bool commit(const Point* dst, uint16_t num);
+    void discard(uint16_t num); // producer gave up on points, counted in dropped
     bool getPoint(Point& p);
-    uint16_t getPoints(Point* points, uint16_t max);
+    uint16_t getPoints(Point* points, uint16_t max, bool untilBlank = false);
+    bool peek(Point& p);
     void clear();
+    uint16_t size();
+
+    uint32_t dropped = 0; // points rejected while full
+    uint32_t underruns = 0; // consumer found the buffer empty after it had data
 
 private:
-    Point buffer[POINT_BUFFER_SIZE];
+    Point* buffer = nullptr;
+    size_t mask = 0;
     volatile size_t head = 0;
     volatile size_t tail = 0;
     portMUX_TYPE spinlock = portMUX_INITIALIZER_UNLOCKED;
+    TaskHandle_t spaceWaiter = nullptr; // producer blocked in waitForSpace
+    uint16_t spaceWanted = 0;
+    bool drained = true;
+    uint32_t clears = 0; // lets getPoints() detect a clear() during its unlocked copy
+    size_t freeSpace();
 };
\ No newline at end of file
@@ -1,25 +1,41 @@
 #include "Renderer.h"
+#include <SDCard.h>
 
-static PointRingBuffer pointBuffer;
+static Point frameBuffer[ILDA_MAX_FRAME_POINTS];
 
 SemaphoreHandle_t Renderer::dacSem = nullptr;
 
+// Point clock: each period is clockTicks + clockRem/clockDen timer ticks, the fraction is
+// dithered by a phase accumulator in the ISR so the long-run rate is exact
+static volatile uint32_t clockTicks = RENDERER_TIMER_HZ / 100000;
+static volatile uint32_t clockRem = 0;
+static volatile uint32_t clockDen = 1;
+static uint32_t clockPhase = 0;
+static portMUX_TYPE clockSpinlock = portMUX_INITIALIZER_UNLOCKED;
+
 void Renderer::shutterLow() { GPIO.out_w1tc = (1 << PIN_Shutter); }
 void Renderer::shutterHigh() { GPIO.out_w1ts = (1 << PIN_Shutter); }
 
-void Renderer::buffer_add_point(const Point& p) { pointBuffer.addPoint(p); }
-void Renderer::buffer_add_points(const Point* p, uint16_t num) { pointBuffer.addPoints(p, num); }
-void Renderer::buffer_clear_points() { pointBuffer.clear(); }
+void Renderer::buffer_add_point(uint8_t src, const Point& p) { buffer_add_points(src, &p, 1); }
+void Renderer::buffer_add_points(uint8_t src, const Point* p, uint16_t num) { mixer.touch(src); mixer.buffer(src).addPoints(p, num); }
+uint16_t Renderer::buffer_reserve(uint8_t src, Point*& dst, uint16_t max) { return mixer.buffer(src).reserve(dst, max); }
+bool Renderer::buffer_commit(uint8_t src, const Point* dst, uint16_t num) { mixer.touch(src); return mixer.buffer(src).commit(dst, num); }
+void Renderer::buffer_discard(uint8_t src, uint16_t num) { mixer.buffer(src).discard(num); }
+bool Renderer::buffer_wait_space(uint8_t src, uint16_t num, TickType_t wait) { return mixer.buffer(src).waitForSpace(num, wait); }
+void Renderer::buffer_clear_points(uint8_t src) { mixer.buffer(src).clear(); }
+uint16_t Renderer::buffer_fill(uint8_t src) { return mixer.buffer(src).size(); }
+uint16_t Renderer::buffer_capacity(uint8_t src) { return mixer.buffer(src).capacity(); }
+uint32_t Renderer::buffer_dropped(uint8_t src) { return mixer.buffer(src).dropped; }
+uint32_t Renderer::buffer_underruns(uint8_t src) { return mixer.buffer(src).underruns; }
 
 void Renderer::start() {
-  timer_val = 1000000 / 100000;
-  timerAlarmWrite(dacTimer, timer_val, true);
+  timerAlarmWrite(dacTimer, clockTicks, true);
   timerAlarmEnable(dacTimer);
   rendererRunning = 1;
 }
 
 void Renderer::reset() {
-  Point p = { 0, 0, 0, 0, 0 };
+  Point p = { 0, 0, 0, 0, 0, 0 };
   dac.dac_write_point(p);
   shutterLow();
 }
@@ -29,29 +45,89 @@ void Renderer::stop() {
   timerWrite(dacTimer, 0);
   rendererRunning = 0;
   reset();
-  buffer_clear_points();
+  for (uint8_t i = 0; i < SOURCE_COUNT; i++) buffer_clear_points(i);
 }
 
 void Renderer::sd_stop() {
   sdRunning = 0;
+  reader.stop();
+  buffer_clear_points(SOURCE_SD);
+  SDCard::lock();
   if (ildaFile) ildaFile.close();
+  SDCard::unlock();
 }
 
 void Renderer::sd_start(File file) {
-  if (ilda.readHeader(file)) { sd_stop(); return; }
+  SDCard::lock();
+  uint8_t err = ilda.readHeader(file, &reader);
+  SDCard::unlock();
+  if (err) { sd_stop(); return; }
   ildaFile = file;
+  optimizer.reset();
   sdRunning = 1;
 }
 
+void Renderer::set_period(uint32_t ticks, uint32_t rem, uint32_t den) {
+  portENTER_CRITICAL(&clockSpinlock);
+  clockTicks = ticks;
+  clockRem = rem;
+  clockDen = den;
+  clockPhase = 0;
+  portEXIT_CRITICAL(&clockSpinlock);
+  timerAlarmWrite(dacTimer, ticks, true);
+}
+
+// Point rate in points per second
+void Renderer::change_rate(uint32_t pps) {
+  if (pps < RENDERER_MIN_PPS || pps > RENDERER_MAX_PPS) return;
+  point_rate = pps;
+  set_period(RENDERER_TIMER_HZ / pps, RENDERER_TIMER_HZ % pps, pps);
+}
+
+// Point period in whole microseconds (IWP TYPE_1, /control?rate=)
 void Renderer::change_freq(uint32_t val) {
-  if (val < 10) return;
-  timer_val = val;
-  timerAlarmWrite(dacTimer, timer_val, true);
+  if (val < 1000000 / RENDERER_MAX_PPS || val > 1000000 / RENDERER_MIN_PPS) return;
+  point_rate = 1000000 / val;
+  set_period(val * (RENDERER_TIMER_HZ / 1000000), 0, 1);
 }
 
 void Renderer::change_brightness(uint8_t val) { if (val <= 100) brightness = val; }
 
+void Renderer::change_fps(uint32_t val) {
+  if (val > RENDERER_MAX_FPS) return;
+  target_fps = val;
+  fps_measured = 0;
+}
+
+// Fill one frame slot of `budget` points, repeating short frames and decimating long ones
+void Renderer::sd_emit_frame(const Point* frame, uint16_t n, uint32_t budget) {
+  uint32_t span = max(budget / n, (uint32_t)1) * n; // source points covered by this slot
+  uint32_t src = 0, acc = 0;
+  Point p[512];
+  uint32_t emitted = 0;
+  while (emitted < budget && sdRunning) {
+    uint16_t count = 0;
+    while (count < 512 && emitted < budget) {
+      p[count++] = frame[src];
+      emitted++;
+      acc += span; // src advances span/budget points per output point
+      while (acc >= budget) { acc -= budget; if (++src == n) src = 0; }
+    }
+    while (!buffer_wait_space(SOURCE_SD, count, pdMS_TO_TICKS(100))) { if (!sdRunning) return; }
+    buffer_add_points(SOURCE_SD, p, count);
+  }
+}
+
 void IRAM_ATTR timerISR() {
+  if (clockRem) {
+    uint32_t next = clockTicks;
+    portENTER_CRITICAL_ISR(&clockSpinlock);
+    clockPhase += clockRem;
+    if (clockPhase >= clockDen) { clockPhase -= clockDen; next++; }
+    portEXIT_CRITICAL_ISR(&clockSpinlock);
+    timer_group_set_alarm_value_in_isr(TIMER_GROUP_0, TIMER_0, next); // timer 0 = group 0, index 0
+  }
+
   BaseType_t xHigherPriorityTaskWoken = pdFALSE;
   xSemaphoreGiveFromISR(Renderer::dacSem, &xHigherPriorityTaskWoken);
   if (xHigherPriorityTaskWoken) portYIELD_FROM_ISR();
@@ -59,31 +135,89 @@ void IRAM_ATTR timerISR() {
 
 void Renderer::SDTask(void* pvParameters) {
   Renderer* self = static_cast<Renderer*>(pvParameters);
+  uint32_t slotAcc = 0;
+  uint32_t lastFrameTime = 0;
+  float frameTimeAvg = 0;
   while (true) {
+    self->optimizer.update();
     if (!self->sdRunning) { vTaskDelay(pdMS_TO_TICKS(10)); continue; }
+
+    // Constant frame-rate mode: one frame per 1/fps slot regardless of its point count
+    if (self->target_fps > 0) {
+      uint8_t fps = self->target_fps;
+      int n = self->ilda.readILDAFrame(frameBuffer, ILDA_MAX_FRAME_POINTS);
+      if (n <= 0) { vTaskDelay(pdMS_TO_TICKS(1)); continue; }
+      self->frame_index = self->ilda.ildaStream.current_frame_idx;
+
+      slotAcc += self->point_rate; // spread the pps/fps remainder so the long-run rate is exact
+      uint32_t budget = slotAcc / fps;
+      slotAcc -= budget * fps;
+      if (budget == 0) continue;
+      uint16_t count = n;
+      const Point* frame = self->optimizer.process(frameBuffer, count, self->frame_index);
+      self->sd_emit_frame(frame, count, budget);
+
+      uint32_t now = micros();
+      if (lastFrameTime != 0) {
+        frameTimeAvg += ((float)(now - lastFrameTime) - frameTimeAvg) / 16;
+        if (frameTimeAvg > 0) self->fps_measured = 1000000.0f / frameTimeAvg;
+      }
+      lastFrameTime = now;
+      continue;
+    }
+    lastFrameTime = 0;
+
     Point p[512];
     int pointsRead = self->ilda.readILDAChunk(p, 512);
+    self->frame_index = self->ilda.ildaStream.current_frame_idx;
     if (pointsRead <= 0) { vTaskDelay(pdMS_TO_TICKS(1)); continue; }
-    while (!pointBuffer.canItFit(pointsRead)) { vTaskDelay(pdMS_TO_TICKS(1)); }
-    self->buffer_add_points(p, pointsRead);
+    while (!self->buffer_wait_space(SOURCE_SD, pointsRead, pdMS_TO_TICKS(100))) { if (!self->sdRunning) break; }
+    if (self->sdRunning) self->buffer_add_points(SOURCE_SD, p, pointsRead);
+  }
+}
+
+// Pattern points are computed straight into the generator's buffer
+void Renderer::GenTask(void* pvParameters) {
+  Renderer* self = static_cast<Renderer*>(pvParameters);
+  while (true) {
+    if (!self->generator.enabled()) { vTaskDelay(pdMS_TO_TICKS(10)); continue; }
+    Point* dst;
+    uint16_t space = self->buffer_reserve(SOURCE_GEN, dst, 256);
+    if (space == 0) { self->buffer_wait_space(SOURCE_GEN, 256, pdMS_TO_TICKS(100)); continue; }
+    uint16_t n = self->generator.fill(dst, space);
+    if (n) self->buffer_commit(SOURCE_GEN, dst, n);
   }
 }
 
 void Renderer::DACTask(void* pvParameters) {
   Renderer* self = static_cast<Renderer*>(pvParameters);
+  bool idle = true;
   while (true) {
-    if (!self->rendererRunning) { vTaskDelay(pdMS_TO_TICKS(10)); continue; }
+    if (!self->rendererRunning) { self->trace.idle(); self->zones.sync(); vTaskDelay(pdMS_TO_TICKS(10)); idle = true; continue; }
     Point points[512];
-    uint16_t n = pointBuffer.getPoints(points, 512);
-    if (n == 0) { vTaskDelay(pdMS_TO_TICKS(1)); self->dac.dac_write_color(0, 0, 0); continue; }
+    uint16_t n = self->mixer.read(points, 512);
+    if (n == 0) {
+      if (!idle) self->trace.underrun();
+      self->trace.idle();
+      self->zones.sync();
+      idle = true;
+      vTaskDelay(pdMS_TO_TICKS(1));
+      self->dac.dac_write_color(0, 0, 0);
+      continue;
+    }
+    idle = false;
+    self->zones.apply(points, n);
+    self->trace.poll();
     for (uint16_t i = 0; i < n; i++) {
       Point& p = points[i];
       if (self->brightness < 100) {
         p.r = (p.r * self->brightness) / 100;
         p.g = (p.g * self->brightness) / 100;
         p.b = (p.b * self->brightness) / 100;
+        p.i = (p.i * self->brightness) / 100;
       }
       if (xSemaphoreTake(dacSem, portMAX_DELAY) == pdTRUE) self->dac.dac_write_point(p);
+      if (self->trace.armed) self->trace.record(p, self->mixer.active);
     }
   }
 }
@@ -94,10 +228,15 @@ void Renderer::begin() {
   dac.begin(spi, PIN_CS, PIN_SCK, PIN_MOSI, PIN_MISO);
 
   dacSem = xSemaphoreCreateBinary();
+  mixer.begin();
+  recorder.begin();
+
+  reader.begin(SD_READAHEAD_DEPTH);
 
-  dacTimer = timerBegin(0, 80, true);
+  dacTimer = timerBegin(0, 80000000 / RENDERER_TIMER_HZ, true);
   timerAttachInterrupt(dacTimer, &timerISR, true);
 
   xTaskCreatePinnedToCore(SDTask, "SDTask", 8192, this, 2, NULL, 0);
   xTaskCreatePinnedToCore(DACTask, "DACTask", 8192, this, 2, NULL, 1);
+  xTaskCreatePinnedToCore(GenTask, "GenTask", 4096, this, 1, NULL, 0);
 }
\ No newline at end of file
@@ -8,6 +8,12 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
 #include <PointRingBuffer.h>
+#include <SourceMixer.h>
+#include <ZoneMask.h>
+#include <PatternGenerator.h>
+#include <FrameOptimizer.h>
+#include <SDRecorder.h>
+#include <TraceCapture.h>
 #include "esp_task_wdt.h"
 
 #define PIN_BTN 0
@@ -19,15 +25,28 @@
 #define PIN_SCK 12
 
 #define POINTS_PER_BUFFER 1024
+#define RENDERER_MAX_FPS 120
+#define RENDERER_TIMER_HZ 40000000 // APB 80 MHz / 2, 25 ns point clock resolution
+#define RENDERER_MIN_PPS 1
+#define RENDERER_MAX_PPS 100000
 
 class Renderer {
   public:
     void shutterLow();
     void shutterHigh();
 
-    void buffer_add_point(const Point& p);
-    void buffer_add_points(const Point* p, uint16_t num);
-    void buffer_clear_points();
+    // Each producer writes its own SourceMixer buffer, src is a RenderSource
+    void buffer_add_point(uint8_t src, const Point& p);
+    void buffer_add_points(uint8_t src, const Point* p, uint16_t num);
+    uint16_t buffer_reserve(uint8_t src, Point*& dst, uint16_t max);
+    bool buffer_commit(uint8_t src, const Point* dst, uint16_t num);
+    void buffer_discard(uint8_t src, uint16_t num); // points a producer could not place, counted as dropped
+    bool buffer_wait_space(uint8_t src, uint16_t num, TickType_t wait);
+    void buffer_clear_points(uint8_t src);
+    uint16_t buffer_fill(uint8_t src);
+    uint16_t buffer_capacity(uint8_t src);
+    uint32_t buffer_dropped(uint8_t src);
+    uint32_t buffer_underruns(uint8_t src);
 
     void start();
     void reset();
@@ -36,23 +55,42 @@ class Renderer {
     void sd_stop();
     void sd_start(File file);
  
+    void change_rate(uint32_t pps);
     void change_freq(uint32_t val);
     void change_brightness(uint8_t val);
+    void change_fps(uint32_t val); // out of range values are ignored, not truncated
 
     void begin();
 
     static void SDTask(void *pvParameters);
     static void DACTask(void *pvParameters);
+    static void GenTask(void *pvParameters);
 
     static SemaphoreHandle_t dacSem;
   
     uint8_t rendererRunning = 0;
     uint8_t sdRunning = 0;
 
-    uint32_t timer_val = 10; // T[us] = 1000000 / f [Hz]
+    uint32_t point_rate = 100000; // [pps], T[us] = 1000000 / f [Hz]
     uint8_t brightness = 100; // 0-100%
+    uint8_t target_fps = 0; // SD frame rate, 0 = stream points as authored
+
+    uint16_t frame_index = 0; // ILDA frame being read
+    float fps_measured = 0; // frame slots actually produced per second
+
+    SDReader reader;
+    SourceMixer mixer;
+    ZoneMask zones;
+    PatternGenerator generator;
+    FrameOptimizer optimizer; // constant frame-rate playback only
+    SDRecorder recorder; // taps IDN/IWP after decode, sources call it directly
+    TraceCapture trace; // points as written to the DAC
+    ILDAProjection& projection() { return ilda.projection; } // 3D stage of SD playback
 
   private:
+    void set_period(uint32_t ticks, uint32_t rem, uint32_t den);
+    void sd_emit_frame(const Point* frame, uint16_t n, uint32_t budget);
+
     spi_device_handle_t spi;
     DAC80508 dac;
     ILDA ilda;
@@ -0,0 +1,114 @@
+#include "SourceMixer.h"
+
+bool SourceMixer::begin() {
+    bool ok = buffers[SOURCE_SD].begin(SOURCE_BUFFER_SD);
+    ok &= buffers[SOURCE_GEN].begin(SOURCE_BUFFER_GEN);
+    for (uint8_t i = 0; i < SOURCE_COUNT; i++) if (SOURCE_STREAMS & (1 << i)) ok &= buffers[i].begin(psramFound() ? POINT_BUFFER_SIZE : POINT_BUFFER_SIZE / 2);
+    return ok;
+}
+
+const char* SourceMixer::name(int8_t src) {
+    static const char* names[SOURCE_COUNT] = { "sd", "idn", "iwp", "gen" };
+    return src >= 0 && src < SOURCE_COUNT ? names[src] : "none";
+}
+
+bool SourceMixer::live(uint8_t src, uint32_t now) {
+    return buffers[src].size() > 0 || (lastWrite[src] && now - lastWrite[src] < timeout);
+}
+
+int8_t SourceMixer::select(uint32_t now) {
+    int8_t best = active >= 0 && live(active, now) ? active : -1;
+    for (uint8_t i = 0; i < SOURCE_COUNT; i++) {
+        if (i == best || !live(i, now)) continue;
+        if (best < 0 || priority[i] > priority[best]) best = i;
+    }
+    return best;
+}
+
+// Blanked lead-in at the first point of the new source, the galvos travel with the beam off
+uint16_t SourceMixer::switchTo(int8_t src, Point* out, uint16_t max) {
+    active = src;
+    pendingPoints = 0;
+    switches++;
+    Point first;
+    if (src < 0 || !buffers[src].peek(first)) return 0;
+    uint16_t n = min<uint16_t>(max, SOURCE_SWITCH_BLANK);
+    for (uint16_t i = 0; i < n; i++) out[i] = { first.x, first.y, 0, 0, 0, 0 };
+    return n;
+}
+
+// Blanked straight move from the last output point, the galvos settle with the beam off
+uint16_t SourceMixer::move(const Point& to, Point* out) {
+    int32_t x0 = (uint16_t)lastOut.x, y0 = (uint16_t)lastOut.y;
+    int32_t dx = (uint16_t)to.x - x0, dy = (uint16_t)to.y - y0;
+    for (uint8_t i = 1; i <= transition; i++) out[i - 1] = { (int16_t)(x0 + dx * i / transition), (int16_t)(y0 + dy * i / transition), 0, 0, 0, 0 };
+    blankPoints += transition;
+    return transition;
+}
+
+// Next source with queued points and a share, its quota is taken from the sources live now
+bool SourceMixer::nextSlot(uint32_t now) {
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < SOURCE_COUNT; i++) if (share[i] && live(i, now)) total += share[i];
+    for (uint8_t k = 1; k <= SOURCE_COUNT; k++) {
+        uint8_t i = (slot + k + SOURCE_COUNT) % SOURCE_COUNT;
+        if (!share[i] || buffers[i].size() == 0) continue;
+        slot = i;
+        slotLeft = max<uint32_t>((uint32_t)compositeFrame * share[i] / total, 1);
+        return true;
+    }
+    return false;
+}
+
+uint16_t SourceMixer::composite(Point* out, uint16_t max) {
+    uint32_t now = millis();
+    uint16_t n = 0;
+    while (n < max) {
+        if (slot < 0 || slotLeft == 0 || buffers[slot].size() == 0) {
+            int8_t from = slot;
+            if (max - n < transition || !nextSlot(now)) break;
+            Point first;
+            if (slot != from && buffers[slot].peek(first)) n += move(first, &out[n]);
+            active = slot;
+            continue;
+        }
+        uint16_t m = buffers[slot].getPoints(&out[n], min<uint16_t>(max - n, slotLeft));
+        points[slot] += m;
+        slotLeft = m ? slotLeft - m : 0;
+        n += m;
+        if (m) lastOut = out[n - 1];
+    }
+    return n;
+}
+
+uint16_t SourceMixer::read(Point* out, uint16_t max) {
+    if (mode == MIX_COMPOSITE) return composite(out, max);
+    uint32_t now = millis();
+    int8_t want = select(now);
+    uint16_t n = 0;
+
+    if (want != active) {
+        if (active >= 0 && buffers[active].size() > 0 && pendingPoints < SOURCE_SWITCH_LIMIT) {
+            // Finish the outgoing source up to its next blanked point
+            n = buffers[active].getPoints(out, max, true);
+            points[active] += n;
+            pendingPoints += n;
+            if (n > 0 && (out[n - 1].r | out[n - 1].g | out[n - 1].b) == 0) n += switchTo(want, &out[n], max - n);
+            if (n > 0) lastOut = out[n - 1];
+            return n;
+        }
+        if (active >= 0 && pendingPoints >= SOURCE_SWITCH_LIMIT) forcedSwitches++;
+        n = switchTo(want, out, max);
+    }
+
+    // Inactive live streams would only play stale points after a fallback
+    for (uint8_t i = 0; i < SOURCE_COUNT; i++) if ((SOURCE_STREAMS & (1 << i)) && i != active && i != want && buffers[i].size() > 0) buffers[i].clear();
+
+    if (active >= 0) {
+        uint16_t m = buffers[active].getPoints(&out[n], max - n);
+        points[active] += m;
+        n += m;
+    }
+    if (n > 0) lastOut = out[n - 1];
+    return n;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <Arduino.h>
+#include "PointRingBuffer.h"
+
+#define SOURCE_TIMEOUT 500 // [ms] a silent, drained source gives up the output
+#define SOURCE_SWITCH_LIMIT 4096 // [points] longest wait for a blanked point before switching anyway
+#define SOURCE_SWITCH_BLANK 8 // blanked points at the new source's start position
+#define SOURCE_BUFFER_SD 2048 // [points] refilled continuously by SDTask
+#define SOURCE_BUFFER_GEN 1024 // [points] short, so pattern changes show quickly
+#define COMPOSITE_FRAME 3000 // [points] one round over all sources, 30 fps at 90 kpps
+#define COMPOSITE_TRANSITION 8 // blanked points moving between two sources
+
+enum RenderSource : uint8_t { SOURCE_SD, SOURCE_IDN, SOURCE_IWP, SOURCE_GEN, SOURCE_COUNT };
+#define SOURCE_STREAMS ((1 << SOURCE_IDN) | (1 << SOURCE_IWP)) // flushed while inactive, others pause
+enum MixMode : uint8_t { MIX_PRIORITY, MIX_COMPOSITE };
+
+// One point buffer per producer, the DAC task only reads the active one. The highest
+// priority live source wins, ties keep the current one. Switching waits for a blanked
+// point of the outgoing source so no lit segment is cut. Live streams that lose the
+// output are flushed, SD playback and the generator just pause in waitForSpace.
+// MIX_COMPOSITE instead time-multiplexes all sources with a share: each round of
+// compositeFrame points gives every source with queued points its share of the budget,
+// joined by blanked moves. Sources are consumed at their share of the point rate only,
+// live senders should pace to their buffer (IWP status replies).
+class SourceMixer {
+public:
+    bool begin();
+    PointRingBuffer& buffer(uint8_t src) { return buffers[src]; }
+    void touch(uint8_t src) { lastWrite[src] = millis() | 1; }
+    uint16_t read(Point* points, uint16_t max); // DAC task
+    static const char* name(int8_t src);
+
+    uint8_t mode = MIX_PRIORITY;
+    uint8_t priority[SOURCE_COUNT] = { 0, 1, 1, 1 }; // SD, IDN, IWP, generator
+    uint8_t share[SOURCE_COUNT] = { 50, 50, 50, 50 }; // composite weights, 0 leaves a source out
+    uint16_t compositeFrame = COMPOSITE_FRAME;
+    uint8_t transition = COMPOSITE_TRANSITION;
+    uint32_t timeout = SOURCE_TIMEOUT; // [ms]
+    volatile int8_t active = -1;
+    uint32_t switches = 0;
+    uint32_t forcedSwitches = 0; // no blanked point within SOURCE_SWITCH_LIMIT
+    uint32_t points[SOURCE_COUNT] = {}; // output per source
+    uint32_t blankPoints = 0; // inserted between sources
+
+private:
+    bool live(uint8_t src, uint32_t now);
+    int8_t select(uint32_t now);
+    uint16_t switchTo(int8_t src, Point* points, uint16_t max);
+    uint16_t composite(Point* points, uint16_t max);
+    bool nextSlot(uint32_t now);
+    uint16_t move(const Point& to, Point* points);
+
+    PointRingBuffer buffers[SOURCE_COUNT];
+    volatile uint32_t lastWrite[SOURCE_COUNT] = {}; // [ms], 0 = never written
+    uint32_t pendingPoints = 0; // output since a switch was requested
+    Point lastOut = {};
+    int8_t slot = -1; // composite source being output
+    uint16_t slotLeft = 0; // of its share this round
+};
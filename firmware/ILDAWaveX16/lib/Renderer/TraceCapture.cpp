@@ -0,0 +1,78 @@
+#include "TraceCapture.h"
+
+// The ring is reset by the DAC task in poll(), between two record() calls. It polls at
+// least every 10 ms, stopped or idle included
+bool TraceCapture::arm(uint16_t every, uint8_t postPercent, bool onUnderrun) {
+  if (!ring) {
+    uint32_t size = psramFound() ? TRACE_SAMPLES_PSRAM : TRACE_SAMPLES_RAM;
+    ring = (TraceSample*)heap_caps_malloc(size * sizeof(TraceSample), psramFound() ? MALLOC_CAP_SPIRAM : MALLOC_CAP_8BIT);
+    if (!ring) return false;
+    mask = size - 1;
+  }
+  armDecimation = max<uint16_t>(every, 1);
+  armPost = min<uint8_t>(postPercent, 100);
+  armUnderrun = onUnderrun;
+  pendingArm = true;
+  while (pendingArm) vTaskDelay(1);
+  return true;
+}
+
+void TraceCapture::restart() {
+  armed = false;
+  decimation = armDecimation;
+  countdown = 1;
+  post = armPost;
+  triggerOnUnderrun = armUnderrun;
+  cause = TRACE_NONE;
+  lastCycles = ESP.getCycleCount();
+  head = 0;
+  triggered = false;
+  armed = true;
+  pendingArm = false;
+}
+
+void TraceCapture::trigger(uint8_t why) {
+  if (!armed || triggered) return;
+  cause = why;
+  triggerHead = head;
+  remaining = max<uint32_t>((uint64_t)(mask + 1) * post / 100, 1);
+  triggered = true;
+}
+
+size_t TraceCapture::exportSize(uint32_t pointRate) {
+  if (armed || !ring) return 0;
+  kept = min(head, mask + 1);
+  header = {};
+  memcpy(header.magic, TRACE_MAGIC, 4);
+  header.version = 2; // TRACE_WRAP samples
+  header.cause = cause;
+  header.decimation = decimation;
+  header.count = kept;
+  header.trigger = cause == TRACE_NONE ? kept : triggerHead - (head - kept);
+  header.cpuHz = ESP.getCpuFreqMHz() * 1000000;
+  header.pointRate = pointRate;
+  return sizeof(header) + kept * sizeof(TraceSample);
+}
+
+// Byte `index` of the export, samples from the oldest kept one on
+size_t TraceCapture::exportRead(uint8_t* buf, size_t maxLen, size_t index) {
+  size_t total = sizeof(header) + kept * sizeof(TraceSample);
+  size_t n = 0;
+  while (n < maxLen && index < total) {
+    size_t chunk;
+    if (index < sizeof(header)) {
+      chunk = min(maxLen - n, sizeof(header) - index);
+      memcpy(buf + n, (const uint8_t*)&header + index, chunk);
+    }
+    else {
+      size_t offset = index - sizeof(header);
+      uint32_t sample = (head - kept + offset / sizeof(TraceSample)) & mask;
+      size_t within = offset % sizeof(TraceSample);
+      chunk = min(maxLen - n, sizeof(TraceSample) - within);
+      memcpy(buf + n, (const uint8_t*)&ring[sample] + within, chunk);
+    }
+    n += chunk;
+    index += chunk;
+  }
+  return n;
+}
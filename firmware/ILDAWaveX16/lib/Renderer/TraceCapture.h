@@ -0,0 +1,99 @@
+#pragma once
+#include <Arduino.h>
+#include <ILDA.h>
+
+#define TRACE_SAMPLES_PSRAM 131072 // 1.5 MB
+#define TRACE_SAMPLES_RAM 2048 // 24 KB
+#define TRACE_POST 10 // [%] of the ring recorded after the trigger
+#define TRACE_MAGIC "IWTR"
+#define TRACE_WRAP 0xFE // source of a marker sample, the cycle counter passed half a turn
+
+enum TraceTrigger : uint8_t { TRACE_NONE, TRACE_UNDERRUN, TRACE_MANUAL }; // manual: /trace?trigger=1 or trigger() from code
+
+typedef struct {
+  uint32_t cycles; // CPU cycle counter when the point was written
+  uint16_t x, y; // DAC codes
+  uint8_t r, g, b; // 8b, after zones and brightness
+  uint8_t source; // SourceMixer active source, 0xFF none
+} TraceSample;
+
+// Export: header, then count samples oldest first, little endian. The 32 bit cycle counter
+// wraps every 2^32 / cpuHz (17.9 s at 240 MHz). A TRACE_WRAP sample with no point is
+// recorded whenever the counter passes half a turn, so consecutive samples are less than
+// a wrap apart and a reader adds 2^32 whenever cycles goes backwards.
+typedef struct __attribute__((packed)) {
+  char magic[4];
+  uint8_t version;
+  uint8_t cause; // TraceTrigger
+  uint16_t decimation;
+  uint32_t count;
+  uint32_t trigger; // first sample recorded after the trigger
+  uint32_t cpuHz; // cycles clock
+  uint32_t pointRate; // [pps]
+} TraceHeader;
+
+// Ring of the points written to the DAC with a cycle counter timestamp. Disabled it costs
+// the DAC task one flag test per point, armed a counter read, a countdown and a 12 byte store. A trigger
+// lets the ring run on for post percent of its length, then it freezes until re-armed.
+class TraceCapture {
+public:
+    bool arm(uint16_t decimation, uint8_t post, bool onUnderrun); // returns once the DAC task restarted the ring
+    void disable() { armed = false; }
+    void trigger(uint8_t cause); // any task
+    void underrun() { if (armed && triggerOnUnderrun) trigger(TRACE_UNDERRUN); }
+    void poll() { if (pendingArm) restart(); } // DAC task, before record()
+    void idle() { poll(); if (armed) clock(ESP.getCycleCount()); } // DAC task while it writes no points
+    uint32_t samples() { return head; } // recorded since arming, the ring keeps the last ones
+    size_t exportSize(uint32_t pointRate); // stopped traces only, 0 while armed
+    size_t exportRead(uint8_t* buf, size_t maxLen, size_t index); // HTTP response filler
+
+    inline void record(const Point& p, int8_t source) {
+        uint32_t now = ESP.getCycleCount();
+        clock(now);
+        if (--countdown) return;
+        countdown = decimation;
+        TraceSample& s = ring[head++ & mask];
+        s.cycles = now;
+        s.x = p.x;
+        s.y = p.y;
+        s.r = p.r >> 8;
+        s.g = p.g >> 8;
+        s.b = p.b >> 8;
+        s.source = source;
+        if (triggered && --remaining == 0) armed = false;
+    }
+
+    volatile bool armed = false; // tested by the DAC task before record()
+    uint8_t exports = 0; // /trace.bin responses in flight, arming would overwrite what they read
+    uint8_t cause = TRACE_NONE;
+    uint16_t decimation = 1; // every Nth point
+    uint8_t post = TRACE_POST;
+    bool triggerOnUnderrun = true;
+
+private:
+    inline void clock(uint32_t now) {
+        if ((now ^ lastCycles) & 0x80000000) {
+            TraceSample& s = ring[head++ & mask];
+            s = { now, 0, 0, 0, 0, 0, TRACE_WRAP };
+            if (triggered && --remaining == 0) armed = false;
+        }
+        lastCycles = now;
+    }
+
+    void restart();
+
+    TraceSample* ring = nullptr;
+    uint32_t mask = 0;
+    uint32_t head = 0;
+    uint32_t kept = 0; // samples in the export
+    uint32_t triggerHead = 0;
+    uint16_t countdown = 1;
+    uint32_t lastCycles = 0;
+    volatile bool triggered = false;
+    volatile uint32_t remaining = 0;
+    volatile bool pendingArm = false; // arm() settings below wait for the DAC task
+    uint16_t armDecimation = 1;
+    uint8_t armPost = TRACE_POST;
+    bool armUnderrun = true;
+    TraceHeader header;
+};
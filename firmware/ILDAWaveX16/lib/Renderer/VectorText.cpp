@@ -0,0 +1,119 @@
+#include "VectorText.h"
+
+// Strokes of "xy" digit pairs on a 4 wide, 6 high grid with y up, separated by spaces
+static const char* const font[64] = {
+  "", "2622 2120", "1615 3635", "1014 3034 0232 0434", // space ! " #
+  "4536160504133342413010 2026", "0046 0516 3041", "4003051626140130 2240", "2625", // $ % & '
+  "36252130", "16252110", "1531 1135 0343", "0343 2125", // ( ) * +
+  "2110", "0343", "2021", "0046", // , - . /
+  "100105163645413010", "152620 1030", "05163645440040", "05163645443313 334241301001", // 0 1 2 3
+  "30360242", "460603334241301001", "4536160501103041423303", "064610", // 4 5 6 7
+  "13040516364544331302011030414233", "4313040516364541301001", "2425 2021", "2425 2110", // 8 9 : ;
+  "460340", "0242 0444", "064300", "05163645442322 2021", // < = > ?
+  "4231223340 3041301001051636454441", "0003264340 0343", "000636454433033342413000", "4536160501103041", // @ A B C
+  "00062644422000", "46060040 0333", "460600 0333", "45361605011030414323", // D E F G
+  "0006 4640 0343", "1636 2620 1030", "4641301001", "0600 4602 1340", // H I J K
+  "060040", "0006244640", "00064046", "100105163645413010", // L M N O
+  "00063645443303", "100105163645413010 2240", "00063645443303 2340", "453616050413334241301001", // P Q R S
+  "0646 2620", "060110304146", "062046", "0610233046", // T U V W
+  "0046 0640", "062346 2320", "06464000", "362616202030", // X Y Z [
+  "0640", "162636404010", "042644", "0040", // \ ] ^ _
+};
+
+// Greedy nearest neighbour over the strokes from the bottom left, reversing a stroke when
+// its far end is closer, so the pen travels blanked as little as possible
+void VectorText::optimize(const char* outline, GlyphPath& g) {
+  uint8_t strokes[8][GLYPH_MAX_VERTICES];
+  uint8_t lengths[8] = {};
+  uint8_t count = 0;
+  for (const char* p = outline; *p && count < 8; ) {
+    if (*p == ' ') { p++; continue; }
+    while (p[0] >= '0' && p[1] >= '0' && lengths[count] < GLYPH_MAX_VERTICES) {
+      strokes[count][lengths[count]++] = (p[0] - '0') << 4 | (p[1] - '0');
+      p += 2;
+    }
+    while (*p && *p != ' ') p++;
+    count++;
+  }
+
+  g.count = 0;
+  g.penUp = 0;
+  bool used[8] = {};
+  uint8_t pen = 0x00;
+  for (uint8_t s = 0; s < count; s++) {
+    int best = -1, bestDist = 1 << 16;
+    bool reverse = false;
+    for (uint8_t i = 0; i < count; i++) {
+      if (used[i]) continue;
+      for (uint8_t end = 0; end < 2; end++) {
+        uint8_t v = strokes[i][end ? lengths[i] - 1 : 0];
+        int dx = (v >> 4) - (pen >> 4), dy = (v & 0xF) - (pen & 0xF);
+        if (dx * dx + dy * dy < bestDist) { bestDist = dx * dx + dy * dy; best = i; reverse = end; }
+      }
+    }
+    used[best] = true;
+    for (uint8_t k = 0; k < lengths[best] && g.count < GLYPH_MAX_VERTICES; k++) {
+      uint8_t v = strokes[best][reverse ? lengths[best] - 1 - k : k];
+      if (k == 0 && (g.count == 0 || g.v[g.count - 1] != v)) g.penUp |= 1u << g.count;
+      else if (k == 0) continue; // stroke continues where the last one ended
+      g.v[g.count++] = v;
+    }
+    pen = g.v[g.count - 1];
+  }
+}
+
+VectorText::VectorText() {
+  for (uint8_t i = 0; i < 64; i++) optimize(font[i], cache[i]);
+}
+
+void VectorText::set(const char* value, int16_t scrollStep) {
+  portENTER_CRITICAL(&spinlock);
+  strncpy(pendingText, value, TEXT_MAX);
+  pendingText[TEXT_MAX] = 0;
+  pendingScroll = scrollStep;
+  changed = true;
+  portEXIT_CRITICAL(&spinlock);
+}
+
+void VectorText::get(char* value, int16_t& scrollStep) {
+  portENTER_CRITICAL(&spinlock);
+  strcpy(value, changed ? pendingText : text);
+  scrollStep = changed ? pendingScroll : scroll;
+  portEXIT_CRITICAL(&spinlock);
+}
+
+void VectorText::frame(TextLineFn line, void* ctx) {
+  if (changed) {
+    portENTER_CRITICAL(&spinlock);
+    memcpy(text, pendingText, sizeof(text));
+    scroll = pendingScroll;
+    changed = false;
+    portEXIT_CRITICAL(&spinlock);
+    length = strlen(text);
+    offset = 32767;
+  }
+
+  int32_t width = (int32_t)length * TEXT_ADVANCE * TEXT_UNIT - TEXT_UNIT;
+  if (scroll == 0) offset = -width / 2;
+  else {
+    offset -= scroll;
+    if (offset + width < -32767) offset = 32767; // scrolled out left, start again from the right
+    if (offset > 32767) offset = -32767 - width;
+  }
+
+  // Glyphs partly outside the scan range are left out rather than clipped
+  int32_t y0 = -3 * TEXT_UNIT;
+  for (uint8_t c = 0; c < length; c++) {
+    int32_t x0 = offset + (int32_t)c * TEXT_ADVANCE * TEXT_UNIT;
+    if (x0 < -32767 || x0 + 4 * TEXT_UNIT > 32767) continue;
+    char ch = text[c];
+    if (ch >= 'a' && ch <= 'z') ch -= 'a' - 'A';
+    if (ch < ' ' || ch > '_') ch = '?';
+    const GlyphPath& g = cache[ch - ' '];
+    for (uint8_t i = 1; i < g.count; i++) {
+      if (g.penUp & (1u << i)) continue;
+      uint8_t a = g.v[i - 1], b = g.v[i];
+      line(ctx, x0 + (a >> 4) * TEXT_UNIT, y0 + (a & 0xF) * TEXT_UNIT, x0 + (b >> 4) * TEXT_UNIT, y0 + (b & 0xF) * TEXT_UNIT);
+    }
+  }
+}
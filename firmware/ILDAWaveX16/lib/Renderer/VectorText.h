@@ -0,0 +1,40 @@
+#pragma once
+#include <Arduino.h>
+
+#define TEXT_MAX 64 // characters
+#define TEXT_UNIT 2184 // font grid step in Q15, a glyph is 4x6 units, 1/5 of the scan height
+#define TEXT_ADVANCE 5 // units per character
+#define GLYPH_MAX_VERTICES 20
+
+typedef void (*TextLineFn)(void* ctx, int16_t x0, int16_t y0, int16_t x1, int16_t y1);
+
+// Single-stroke vector font for printable ASCII, lowercase drawn as uppercase. Glyph
+// outlines are parsed once into a cache with their strokes reordered (and reversed) by
+// nearest neighbour, so each glyph is one short path with few blanked moves. Text and
+// scroll position live in fixed buffers, updates are taken over at the next frame.
+class VectorText {
+public:
+    VectorText();
+    void set(const char* text, int16_t scroll); // scroll in Q15 per frame, 0 = centred
+    void get(char* text, int16_t& scroll);
+    void frame(TextLineFn line, void* ctx); // lit strokes of the next frame, Q15 coordinates with y up
+
+private:
+    typedef struct {
+        uint8_t count;
+        uint8_t v[GLYPH_MAX_VERTICES]; // x << 4 | y on the 4x6 grid
+        uint32_t penUp; // bit i: v[i] is reached by a blanked move
+    } GlyphPath;
+
+    static void optimize(const char* outline, GlyphPath& g);
+
+    GlyphPath cache[64]; // ' ' to '_'
+    char text[TEXT_MAX + 1] = "";
+    char pendingText[TEXT_MAX + 1] = "";
+    int16_t scroll = 0;
+    int16_t pendingScroll = 0;
+    volatile bool changed = false;
+    int32_t offset = 32767; // left edge of the text while scrolling
+    uint8_t length = 0;
+    portMUX_TYPE spinlock = portMUX_INITIALIZER_UNLOCKED;
+};
@@ -0,0 +1,137 @@
+#include "ZoneMask.h"
+
+#define CELLS (1 << (16 - ZONE_GRID_SHIFT))
+#define CELL_SIZE (1 << ZONE_GRID_SHIFT)
+
+static inline void setCell(uint32_t* bits, int32_t cx, int32_t cy) {
+  uint32_t cell = (cy << (16 - ZONE_GRID_SHIFT)) | cx;
+  bits[cell >> 5] |= 1u << (cell & 31);
+}
+
+// Even-odd rule, an edge counts for y in [min, max) so vertices are not crossed twice
+static bool inPolygon(const Zone& z, int32_t x, int32_t y) {
+  bool in = false;
+  for (uint8_t i = 0, j = z.vertices - 1; i < z.vertices; j = i++) {
+    int32_t yi = z.y[i], yj = z.y[j];
+    if ((yi > y) == (yj > y)) continue;
+    int32_t xi = z.x[i], xj = z.x[j];
+    if (x < xi + (int64_t)(xj - xi) * (y - yi) / (yj - yi)) in = !in;
+  }
+  return in;
+}
+
+bool ZoneMask::contains(const ZoneMap* m, uint16_t x, uint16_t y) {
+  for (uint8_t i = 0; i < ZONE_MAX; i++) if (m->zones[i].vertices && inPolygon(m->zones[i], x, y)) return true;
+  return false;
+}
+
+// Edge cells by walking every cell an edge passes through, interior cells by a scanline
+// fill through the cell centres
+void ZoneMask::rasterize(ZoneMap* m, const Zone& z) {
+  for (uint8_t i = 0, j = z.vertices - 1; i < z.vertices; j = i++) {
+    int32_t x0 = z.x[j], y0 = z.y[j], x1 = z.x[i], y1 = z.y[i];
+    int32_t cx = x0 >> ZONE_GRID_SHIFT, cy = y0 >> ZONE_GRID_SHIFT;
+    int32_t ex = x1 >> ZONE_GRID_SHIFT, ey = y1 >> ZONE_GRID_SHIFT;
+    int32_t sx = ex > cx ? 1 : -1, sy = ey > cy ? 1 : -1;
+    int64_t adx = abs(x1 - x0), ady = abs(y1 - y0);
+    setCell(m->edge, cx, cy);
+    while (cx != ex || cy != ey) {
+      // Compare the distances to the next vertical and horizontal cell border
+      int64_t bx = abs(((cx + (sx > 0)) << ZONE_GRID_SHIFT) - x0);
+      int64_t by = abs(((cy + (sy > 0)) << ZONE_GRID_SHIFT) - y0);
+      int64_t tx = cx == ex ? INT64_MAX : bx * ady;
+      int64_t ty = cy == ey ? INT64_MAX : by * adx;
+      if (tx <= ty) cx += sx;
+      if (ty <= tx) cy += sy;
+      setCell(m->edge, cx, cy);
+    }
+  }
+
+  int32_t xs[ZONE_MAX_VERTICES];
+  for (int32_t row = 0; row < CELLS; row++) {
+    int32_t yc = row * CELL_SIZE + CELL_SIZE / 2;
+    uint8_t n = 0;
+    for (uint8_t i = 0, j = z.vertices - 1; i < z.vertices; j = i++) {
+      int32_t yi = z.y[i], yj = z.y[j];
+      if ((yi > yc) == (yj > yc)) continue;
+      xs[n++] = z.x[i] + (int64_t)(z.x[j] - z.x[i]) * (yc - yi) / (yj - yi);
+    }
+    for (uint8_t a = 1; a < n; a++) for (uint8_t b = a; b > 0 && xs[b - 1] > xs[b]; b--) { int32_t t = xs[b]; xs[b] = xs[b - 1]; xs[b - 1] = t; }
+    for (uint8_t k = 0; k + 1 < n; k += 2) {
+      // Cells whose centre lies in [xs[k], xs[k + 1]), shifts round towards -inf
+      int32_t c0 = max<int32_t>((xs[k] - CELL_SIZE / 2 + CELL_SIZE - 1) >> ZONE_GRID_SHIFT, 0);
+      int32_t c1 = min<int32_t>((xs[k + 1] - CELL_SIZE / 2 - 1) >> ZONE_GRID_SHIFT, CELLS - 1);
+      for (int32_t c = c0; c <= c1; c++) setCell(m->inside, c, row);
+    }
+  }
+}
+
+bool ZoneMask::rebuild() {
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < ZONE_MAX; i++) if (zones[i].vertices) count++;
+
+  ZoneMap* old = map;
+  if (count == 0) {
+    if (!old) return true;
+    map = nullptr;
+  } else {
+    if (!spare) spare = (ZoneMap*)heap_caps_malloc(sizeof(ZoneMap), MALLOC_CAP_8BIT);
+    if (!spare) return false;
+    memset(spare, 0, sizeof(ZoneMap));
+    memcpy(spare->zones, zones, sizeof(zones));
+    spare->count = count;
+    for (uint8_t i = 0; i < ZONE_MAX; i++) if (zones[i].vertices) rasterize(spare, zones[i]);
+    map = spare;
+  }
+  // apply() loads map once per batch. Once the DAC task acknowledges this swap it has
+  // started a batch after it, so no batch still reads the old map
+  uint32_t swap = ++published;
+  while (old && acked != swap) vTaskDelay(1);
+  if (count == 0) heap_caps_free(spare); // keep one spare, the old map takes its place
+  spare = old;
+  return true;
+}
+
+bool ZoneMask::setZone(uint8_t id, const uint16_t* x, const uint16_t* y, uint8_t vertices) {
+  if (id >= ZONE_MAX || vertices < 3 || vertices > ZONE_MAX_VERTICES) return false;
+  if (!lock) lock = xSemaphoreCreateMutex();
+  xSemaphoreTake(lock, portMAX_DELAY);
+  Zone previous = zones[id];
+  zones[id].vertices = vertices;
+  memcpy(zones[id].x, x, vertices * sizeof(uint16_t));
+  memcpy(zones[id].y, y, vertices * sizeof(uint16_t));
+  bool ok = rebuild();
+  if (!ok) zones[id] = previous; // keep zones matching the active map
+  xSemaphoreGive(lock);
+  return ok;
+}
+
+void ZoneMask::clearZone(uint8_t id) {
+  if (id >= ZONE_MAX) return;
+  if (!lock) lock = xSemaphoreCreateMutex();
+  xSemaphoreTake(lock, portMAX_DELAY);
+  uint8_t previous = zones[id].vertices;
+  zones[id].vertices = 0;
+  if (!rebuild()) zones[id].vertices = previous;
+  xSemaphoreGive(lock);
+}
+
+void ZoneMask::apply(Point* points, uint16_t n) {
+  uint32_t seen = published; // before map, a swap counted here is already visible in map
+  const ZoneMap* m = map;
+  acked = seen;
+  if (!m) return;
+  for (uint16_t i = 0; i < n; i++) {
+    Point& p = points[i];
+    uint16_t x = p.x, y = p.y;
+    uint32_t cell = ((uint32_t)(y >> ZONE_GRID_SHIFT) << (16 - ZONE_GRID_SHIFT)) | (x >> ZONE_GRID_SHIFT);
+    uint32_t bit = 1u << (cell & 31);
+    if (m->edge[cell >> 5] & bit) {
+      exactTests++;
+      if (!contains(m, x, y)) continue;
+    }
+    else if (!(m->inside[cell >> 5] & bit)) continue;
+    p.r = p.g = p.b = p.i = 0;
+    masked++;
+  }
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <Arduino.h>
+#include <ILDA.h>
+
+#define ZONE_MAX 8
+#define ZONE_MAX_VERTICES 16
+#define ZONE_GRID_SHIFT 8 // 256x256 cells of 256x256 DAC codes
+#define ZONE_GRID_WORDS (1 << (2 * (16 - ZONE_GRID_SHIFT) - 5)) // 32 cells per word, 8 KB per map
+
+typedef struct {
+  uint8_t vertices; // 0 = unused, 3 or more for a polygon
+  uint16_t x[ZONE_MAX_VERTICES];
+  uint16_t y[ZONE_MAX_VERTICES];
+} Zone;
+
+// Blanking zones in DAC coordinates. Polygons are rasterized once per edit into two
+// coarse bitmaps: cells entirely inside a zone and cells crossed by an edge. A point then
+// costs a shift and a bit test; only points in edge cells get the exact polygon test.
+// Edits build a spare map and swap it in, the DAC task never sees a half built one, and
+// the replaced map is only reused once the DAC task has acknowledged the swap.
+class ZoneMask {
+public:
+    bool setZone(uint8_t id, const uint16_t* x, const uint16_t* y, uint8_t vertices);
+    void clearZone(uint8_t id);
+    const Zone& zone(uint8_t id) const { return zones[id]; }
+    void apply(Point* points, uint16_t n); // DAC task, blanks points inside any zone
+    void sync() { acked = published; } // DAC task, between batches that skip apply()
+
+    uint32_t masked = 0; // points blanked
+    uint32_t exactTests = 0; // points that needed the polygon test
+
+private:
+    typedef struct {
+        uint32_t inside[ZONE_GRID_WORDS];
+        uint32_t edge[ZONE_GRID_WORDS];
+        Zone zones[ZONE_MAX];
+        uint8_t count;
+    } ZoneMap;
+
+    bool rebuild();
+    static bool contains(const ZoneMap* m, uint16_t x, uint16_t y);
+    static void rasterize(ZoneMap* m, const Zone& z);
+
+    Zone zones[ZONE_MAX] = {};
+    ZoneMap* volatile map = nullptr; // read by the DAC task, nullptr without zones
+    ZoneMap* spare = nullptr;
+    volatile uint32_t published = 0; // map swaps
+    volatile uint32_t acked = 0; // last swap the DAC task has seen, the old map is free from then on
+    SemaphoreHandle_t lock = nullptr;
+};
@@ -1,8 +1,15 @@
 #include "SDCard.h"
+#include "SDUpload.h"
 
 SPIClass SDSPI(FSPI);
 
+SemaphoreHandle_t SDCard::busMutex = nullptr;
+
+bool SDCard::lock(TickType_t wait) { return busMutex == nullptr || xSemaphoreTakeRecursive(busMutex, wait) == pdTRUE; }
+void SDCard::unlock() { if (busMutex) xSemaphoreGiveRecursive(busMutex); }
+
 void SDCard::begin() {
+  busMutex = xSemaphoreCreateRecursiveMutex();
   SDSPI.begin(PIN_SD_SCK, PIN_SD_MISO, PIN_SD_MOSI, PIN_SD_CS);
 }
 
@@ -73,13 +80,20 @@ void SDCard::list() {
   }
 }
 
+// Playable ILDA files only, the upload temp file and .idx sidecars of older firmware stay hidden
+static bool listed(const char* path) {
+  if (strcmp(path, SD_UPLOAD_TMP_PATH) == 0) return false;
+  const char* ext = strrchr(path, '.');
+  return ext && strncasecmp(ext, ".ild", 4) == 0; // .ild and .ilda, not .idx
+}
+
 void SDCard::listFiles(vector<String>& list, const char* path) {
   File root = SD.open(path);
   if (!root) return;
   File file = root.openNextFile();
   while (file) {
     if (file.isDirectory()) listFiles(list, file.path());
-    else if (strstr(file.path(), ".ild") || strstr(file.path(), ".ILD")) list.push_back(file.path());    
+    else if (listed(file.path())) list.push_back(file.path());
     file.close();
     file = root.openNextFile();
   }
@@ -100,7 +114,7 @@ String listFilesRecursive(const char *dirname, int depth) {
     
     if (file.isDirectory()) {
       rows += listFilesRecursive(fullPath.c_str(), depth + 1);
-    } else if (strstr(file.path(), ".ild") || strstr(file.path(), ".ILD")) {
+    } else if (listed(fullPath.c_str())) {
       rows += "<tr data-filename='" + fullPath + "'>";
       rows += "<td>" + fullPath + "</td>";
       rows += "<td>" + String(file.size()) + " bytes</td>";
@@ -113,7 +127,10 @@ String listFilesRecursive(const char *dirname, int depth) {
 }
 
 String SDCard::generateFileRows() {
-  return listFilesRecursive("/", 0);
+  lock();
+  String rows = listFilesRecursive("/", 0);
+  unlock();
+  return rows;
 }
 
 void SDCard::read(const char* path) {
@@ -133,5 +150,8 @@ void SDCard::read(const char* path) {
 }
 
 File SDCard::getFile(const char* path) {
-  return SD.open(path);
+  lock();
+  File file = SD.open(path);
+  unlock();
+  return file;
 }
\ No newline at end of file
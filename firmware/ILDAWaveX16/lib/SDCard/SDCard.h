@@ -6,6 +6,8 @@
 #include "FS.h"
 #include "SD.h"
 #include "SPI.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 
 using namespace std;
 
@@ -23,7 +25,12 @@ class SDCard {
     String generateFileRows();
     void read(const char* path);
     File getFile(const char* path);
+
+    // SD bus arbitration between playback, uploads and recording
+    static bool lock(TickType_t wait = portMAX_DELAY);
+    static void unlock();
   private:
+    static SemaphoreHandle_t busMutex;
 };
 
 #endif /* SDCARD_H */
\ No newline at end of file
@@ -0,0 +1,114 @@
+#include "SDReader.h"
+#include "SDCard.h"
+
+void SDReader::begin(uint8_t d) {
+  depth = constrain(d, (uint8_t)2, (uint8_t)SD_READAHEAD_MAX_DEPTH);
+  freeQueue = xQueueCreate(depth, sizeof(SDBlock*));
+  readyQueue = xQueueCreate(depth, sizeof(SDBlock*));
+  for (uint8_t i = 0; i < depth; i++) {
+    blocks[i].data = (uint8_t*)heap_caps_malloc(SD_READ_BLOCK_SIZE, MALLOC_CAP_DMA);
+    SDBlock* b = &blocks[i];
+    if (b->data) xQueueSend(freeQueue, &b, 0);
+  }
+  xTaskCreatePinnedToCore(ReaderTask, "SDReader", 4096, this, 3, &readerTask, 0);
+}
+
+void SDReader::start(File f, uint32_t offset) {
+  SDCard::lock();
+  file = f;
+  SDCard::unlock();
+  running = true;
+  seek(offset);
+}
+
+void SDReader::stop() {
+  running = false;
+  generation++;
+}
+
+// Restart streaming at offset; blocks of the previous generation are dropped on read
+void SDReader::seek(uint32_t offset) {
+  seekOffset = offset;
+  generation++;
+  xTaskNotifyGive(readerTask);
+}
+
+uint8_t SDReader::ready() { return readyQueue ? uxQueueMessagesWaiting(readyQueue) : 0; }
+
+// Return the block being consumed to the producer
+void SDReader::release() {
+  if (!current) return;
+  xQueueSend(freeQueue, &current, 0);
+  current = nullptr;
+}
+
+// Blocking sequential read; returns short only at EOF or when stopped/restarted by another task
+size_t SDReader::read(uint8_t* dst, size_t len) {
+  size_t copied = 0;
+  uint32_t entryGeneration = generation;
+  while (copied < len) {
+    if (current && current->generation != generation) release(); // restarted meanwhile
+    if (!current) {
+      if (!running || generation != entryGeneration) break;
+      if (xQueueReceive(readyQueue, &current, pdMS_TO_TICKS(100)) != pdTRUE) continue; // producer stalled
+      if (current->generation != generation) { release(); continue; }
+      pos = current->start;
+    }
+
+    size_t n = min((size_t)(current->len - pos), len - copied);
+    memcpy(dst + copied, current->data + pos, n);
+    copied += n;
+    pos += n;
+
+    if (pos >= current->len) {
+      bool eof = current->eof;
+      release();
+      if (eof) break;
+    }
+  }
+  return copied;
+}
+
+void SDReader::ReaderTask(void* pvParameters) {
+  SDReader* self = static_cast<SDReader*>(pvParameters);
+  uint32_t generation = self->generation;
+  uint32_t position = 0;
+  bool eof = true;
+
+  while (true) {
+    // Idle until started, sought or back at the head of a new generation
+    if (!self->running || (eof && generation == self->generation)) { ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100)); continue; }
+
+    SDBlock* block;
+    if (xQueueReceive(self->freeQueue, &block, pdMS_TO_TICKS(100)) != pdTRUE) continue;
+
+    uint32_t latest = self->generation; // offset is stored before the bump, a newer seek only costs a block
+    bool reposition = generation != latest;
+    block->start = 0;
+    if (reposition) {
+      uint32_t offset = self->seekOffset;
+      generation = latest;
+      position = offset & ~(uint32_t)511; // keep reads sector aligned
+      block->start = offset - position;
+    }
+
+    uint32_t t0 = micros();
+    SDCard::lock();
+    size_t n = 0;
+    if (self->file && (!reposition || self->file.seek(position))) n = self->file.read(block->data, SD_READ_BLOCK_SIZE);
+    SDCard::unlock();
+    uint32_t dt = micros() - t0;
+
+    self->lastReadLatency = dt;
+    if (dt > self->maxReadLatency) self->maxReadLatency = dt;
+    self->blocksRead++;
+
+    position += n;
+    eof = n < SD_READ_BLOCK_SIZE;
+    block->len = n;
+    block->eof = eof;
+    block->generation = generation;
+    if (block->start > block->len) block->start = block->len;
+    xQueueSend(self->readyQueue, &block, portMAX_DELAY);
+  }
+}
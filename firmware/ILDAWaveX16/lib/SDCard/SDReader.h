@@ -0,0 +1,57 @@
+#ifndef SDREADER_H
+#define SDREADER_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "FS.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#define SD_READ_BLOCK_SIZE 4096 // multiple of the 512 B sector size
+#ifndef SD_READAHEAD_DEPTH
+#define SD_READAHEAD_DEPTH 4 // blocks in flight or ready ahead of the decoder, override with -D
+#endif
+#define SD_READAHEAD_MAX_DEPTH 8
+
+typedef struct {
+  uint8_t* data;
+  uint16_t start; // first valid byte (reads are sector aligned)
+  uint16_t len; // end of valid data
+  uint32_t generation; // seek generation the block belongs to
+  bool eof;
+} SDBlock;
+
+// Sequential read-ahead over a single file. A producer task keeps up to `depth` blocks
+// filled ahead of the consumer, which copies out of them without touching the SD card.
+class SDReader {
+  public:
+    void begin(uint8_t depth = SD_READAHEAD_DEPTH);
+    void start(File file, uint32_t offset);
+    void stop();
+    void seek(uint32_t offset);
+    size_t read(uint8_t* dst, size_t len);
+
+    uint8_t depth = 0;
+    uint32_t blocksRead = 0;
+    uint32_t lastReadLatency = 0; // [us]
+    uint32_t maxReadLatency = 0; // [us]
+    uint8_t ready();
+
+  private:
+    static void ReaderTask(void* pvParameters);
+    void release();
+
+    SDBlock blocks[SD_READAHEAD_MAX_DEPTH];
+    QueueHandle_t freeQueue = nullptr;
+    QueueHandle_t readyQueue = nullptr;
+    TaskHandle_t readerTask = nullptr;
+    SDBlock* current = nullptr;
+    uint16_t pos = 0;
+    File file;
+    volatile bool running = false;
+    std::atomic<uint32_t> generation{0}; // bumped by stop() and seek() from any task
+    volatile uint32_t seekOffset = 0;
+};
+
+#endif /* SDREADER_H */
@@ -0,0 +1,223 @@
+#include "SDRecorder.h"
+
+#define SD_RECORD_WRITE_SLICE 4096 // bytes written per SD lock, bounds the stall seen by playback
+#define SD_RECORD_HEADER 32
+#define SD_RECORD_POINT 8 // format 5: X Y status B G R
+
+typedef struct {
+  uint8_t buffer;
+  uint32_t len;
+} RecordBlock;
+
+static void putHeader(uint8_t* dst, uint16_t records, uint16_t number) {
+  ILDA_Header_t h = {};
+  memcpy(h.ilda, "ILDA", 4);
+  h.format = 5;
+  memcpy(h.frame_name, "RECORD  ", 8);
+  memcpy(h.company_name, "IWX16   ", 8);
+  h.records = htons(records);
+  h.frame_number = htons(number);
+  h.total_frames = 0; // not known while recording
+  memcpy(dst, &h, sizeof(h));
+}
+
+// Inverse of ILDA::decodeRecord
+static void putPoint(uint8_t* dst, const Point& p) {
+  int32_t x = (int32_t)(uint16_t)p.x - 0x8000;
+  int32_t y = min<int32_t>(0x8000 - (int32_t)(uint16_t)p.y, 32767);
+  dst[0] = x >> 8;
+  dst[1] = x;
+  dst[2] = y >> 8;
+  dst[3] = y;
+  dst[4] = (p.r | p.g | p.b) ? 0 : 0b01000000;
+  dst[5] = p.b >> 8;
+  dst[6] = p.g >> 8;
+  dst[7] = p.r >> 8;
+}
+
+void SDRecorder::begin() {
+  writeQueue = xQueueCreate(2, sizeof(RecordBlock));
+  freeSem = xSemaphoreCreateCounting(2, 2);
+  lock = xSemaphoreCreateMutex();
+  xTaskCreatePinnedToCore(WriterTask, "SDRecorder", 4096, this, 1, NULL, 0);
+}
+
+uint8_t SDRecorder::start(const char* path, uint8_t src, uint8_t mode, uint16_t ms) {
+  if (active || finishing) { error = "Recording in progress"; return 1; }
+
+  bufferSize = psramFound() ? SD_RECORD_BUFFER_PSRAM : SD_RECORD_BUFFER_RAM;
+  for (uint8_t i = 0; i < 2; i++) {
+    buffers[i] = (uint8_t*)heap_caps_malloc(bufferSize, psramFound() ? MALLOC_CAP_SPIRAM : MALLOC_CAP_DMA);
+  }
+  if (!buffers[0] || !buffers[1]) {
+    for (uint8_t i = 0; i < 2; i++) { heap_caps_free(buffers[i]); buffers[i] = nullptr; }
+    error = "Out of memory";
+    return 1;
+  }
+
+  SDCard::lock();
+  file = SD.open(path, FILE_WRITE);
+  SDCard::unlock();
+  if (!file) {
+    for (uint8_t i = 0; i < 2; i++) { heap_caps_free(buffers[i]); buffers[i] = nullptr; }
+    error = "Cannot create file";
+    return 1;
+  }
+
+  source = src;
+  split = mode;
+  slice = max<uint16_t>(ms, 1);
+  maxFrame = min<size_t>(SD_RECORD_MAX_FRAME, (bufferSize - SD_RECORD_HEADER) / SD_RECORD_POINT);
+  fill = 0;
+  current = 0;
+  frameOpen = false;
+  skipping = false;
+  frames = points = droppedFrames = droppedPoints = bytesWritten = maxWriteTime = 0;
+  writeFailed = false;
+  error = nullptr;
+
+  xSemaphoreTake(freeSem, portMAX_DELAY); // producers own the first buffer
+  active = true;
+  return 0;
+}
+
+// Queue bytes [0, len) of the current buffer for the writer task
+void SDRecorder::submit(size_t len) {
+  RecordBlock block = { current, (uint32_t)len };
+  xQueueSend(writeQueue, &block, portMAX_DELAY); // two slots, never full
+}
+
+// Switch to the other buffer if the writer is done with it, carrying the last `keep`
+// bytes (the open frame) over. False when it is still being written.
+bool SDRecorder::nextBuffer(size_t keep) {
+  if (xSemaphoreTake(freeSem, 0) != pdTRUE) return false;
+  memcpy(buffers[current ^ 1], buffers[current] + fill - keep, keep);
+  submit(fill - keep);
+  current ^= 1;
+  frameStart -= fill - keep;
+  fill = keep;
+  return true;
+}
+
+bool SDRecorder::openFrame() {
+  if (fill + SD_RECORD_HEADER + SD_RECORD_POINT > bufferSize && !nextBuffer(0)) return false;
+  frameStart = fill;
+  fill += SD_RECORD_HEADER;
+  frameCount = 0;
+  frameTime = millis();
+  frameOpen = true;
+  return true;
+}
+
+void SDRecorder::endFrame() {
+  if (!frameOpen) return;
+  frameOpen = false;
+  if (frameCount == 0) { fill = frameStart; return; }
+  buffers[current][fill - SD_RECORD_POINT + 4] |= 0b10000000; // last point
+  putHeader(buffers[current] + frameStart, frameCount, frames);
+  frames++;
+  points += frameCount;
+}
+
+// The writer is behind: discard the frame in progress and the rest of it
+void SDRecorder::dropFrame() {
+  if (frameOpen) {
+    fill = frameStart;
+    droppedPoints += frameCount;
+    frameOpen = false;
+  }
+  droppedFrames++;
+  skipping = true;
+  skipped = 0;
+}
+
+void SDRecorder::add(uint8_t src, const Point* p, uint16_t n) {
+  if (!active || src != source || n == 0) return;
+  xSemaphoreTake(lock, portMAX_DELAY);
+  if (active) {
+    // Time slices are checked per batch, producers hand over a few ms of points at most
+    if (split == RECORD_SPLIT_TIME && millis() - frameTime >= slice) {
+      endFrame();
+      skipping = false;
+      frameTime = millis();
+    }
+    for (uint16_t i = 0; i < n; i++) {
+      if (skipping) {
+        droppedPoints++;
+        if (++skipped >= maxFrame) skipping = false; // where a long frame is split anyway
+        continue;
+      }
+      if (frameOpen && frameCount == maxFrame) endFrame();
+      if (!frameOpen && !openFrame()) { dropFrame(); droppedPoints++; continue; }
+      if (fill + SD_RECORD_POINT > bufferSize && !nextBuffer(fill - frameStart)) { dropFrame(); droppedPoints++; continue; }
+      putPoint(buffers[current] + fill, p[i]);
+      fill += SD_RECORD_POINT;
+      frameCount++;
+    }
+  }
+  xSemaphoreGive(lock);
+}
+
+void SDRecorder::mark(uint8_t src) {
+  if (!active || src != source || split != RECORD_SPLIT_MARKER) return;
+  xSemaphoreTake(lock, portMAX_DELAY);
+  if (active) {
+    endFrame();
+    skipping = false;
+  }
+  xSemaphoreGive(lock);
+}
+
+uint8_t SDRecorder::stop() {
+  if (!active) return 1;
+  xSemaphoreTake(lock, portMAX_DELAY);
+  bool stopping = active;
+  active = false; // producers check under the lock, the buffers are ours from here on
+  finishing = stopping;
+  if (stopping) endFrame();
+  xSemaphoreGive(lock);
+  if (!stopping) return 1;
+
+  // Terminator header, waiting for the writer without the lock so add() never blocks
+  if (fill + SD_RECORD_HEADER > bufferSize) {
+    submit(fill);
+    xSemaphoreTake(freeSem, portMAX_DELAY);
+    current ^= 1;
+    fill = 0;
+  }
+  putHeader(buffers[current] + fill, 0, frames);
+  fill += SD_RECORD_HEADER;
+  submit(fill);
+  for (uint8_t i = 0; i < 2; i++) xSemaphoreTake(freeSem, portMAX_DELAY); // both written
+  for (uint8_t i = 0; i < 2; i++) xSemaphoreGive(freeSem);
+
+  SDCard::lock();
+  file.close();
+  SDCard::unlock();
+  for (uint8_t i = 0; i < 2; i++) { heap_caps_free(buffers[i]); buffers[i] = nullptr; }
+  if (writeFailed) error = "SD write failed";
+  finishing = false;
+  return error ? 1 : 0;
+}
+
+void SDRecorder::WriterTask(void* pvParameters) {
+  SDRecorder* self = static_cast<SDRecorder*>(pvParameters);
+  RecordBlock block;
+  while (true) {
+    if (xQueueReceive(self->writeQueue, &block, portMAX_DELAY) != pdTRUE) continue;
+    const uint8_t* data = self->buffers[block.buffer];
+    size_t offset = 0;
+    while (offset < block.len && !self->writeFailed) {
+      size_t n = min((size_t)SD_RECORD_WRITE_SLICE, block.len - offset);
+      uint32_t t0 = micros();
+      SDCard::lock();
+      if (self->file.write(data + offset, n) != n) self->writeFailed = true;
+      SDCard::unlock();
+      uint32_t dt = micros() - t0;
+      if (dt > self->maxWriteTime) self->maxWriteTime = dt;
+      offset += n;
+      self->bytesWritten += n;
+    }
+    xSemaphoreGive(self->freeSem);
+  }
+}
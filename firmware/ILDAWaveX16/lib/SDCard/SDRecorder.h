@@ -0,0 +1,72 @@
+#ifndef SDRECORDER_H
+#define SDRECORDER_H
+
+#include <Arduino.h>
+#include "FS.h"
+#include "SD.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include <SDCard.h>
+#include <ILDA.h>
+
+#define SD_RECORD_BUFFER_PSRAM 65536 // per buffer, multiple of the 512 B sector size
+#define SD_RECORD_BUFFER_RAM 16384
+#define SD_RECORD_MAX_FRAME 4096 // [points] longer frames are split
+#define SD_RECORD_SLICE 33 // [ms] default frame length when splitting by time
+
+enum RecordSplit : uint8_t { RECORD_SPLIT_MARKER, RECORD_SPLIT_TIME };
+
+// Records one point source to SD as ILDA format 5. Producers (network tasks) convert
+// points straight into one of two large buffers and never wait: when the writer task is
+// still busy with the other buffer the frame in progress is dropped and counted. Frames
+// end at source markers (IDN frames, IWP TYPE 0) or every slice milliseconds.
+class SDRecorder {
+  public:
+    void begin();
+    uint8_t start(const char* path, uint8_t source, uint8_t split, uint16_t slice);
+    uint8_t stop();
+    void add(uint8_t source, const Point* points, uint16_t n); // never blocks
+    void mark(uint8_t source); // frame boundary from the source
+    void frame(uint8_t source, const Point* points, uint16_t n) { add(source, points, n); mark(source); }
+
+    volatile bool active = false;
+    volatile bool finishing = false; // stop() is flushing the last buffers
+    uint8_t source = 0;
+    uint8_t split = RECORD_SPLIT_MARKER;
+    uint16_t slice = SD_RECORD_SLICE; // [ms]
+    const char* error = nullptr;
+    uint32_t frames = 0;
+    uint32_t points = 0;
+    uint32_t droppedFrames = 0; // writer behind, frame discarded
+    uint32_t droppedPoints = 0;
+    uint32_t bytesWritten = 0;
+    uint32_t maxWriteTime = 0; // [us]
+
+  private:
+    static void WriterTask(void* pvParameters);
+    bool openFrame();
+    void endFrame();
+    void dropFrame();
+    bool nextBuffer(size_t keep);
+    void submit(size_t len);
+
+    uint8_t* buffers[2] = { nullptr, nullptr };
+    size_t bufferSize = 0;
+    size_t fill = 0;
+    uint8_t current = 0; // held by the producers while recording
+    uint16_t maxFrame = SD_RECORD_MAX_FRAME;
+    bool frameOpen = false;
+    bool skipping = false; // rest of a dropped frame
+    uint16_t skipped = 0;
+    size_t frameStart = 0; // header offset of the open frame in the current buffer
+    uint16_t frameCount = 0;
+    uint32_t frameTime = 0; // [ms]
+    QueueHandle_t writeQueue = nullptr;
+    SemaphoreHandle_t freeSem = nullptr; // counts idle buffers
+    SemaphoreHandle_t lock = nullptr; // producers against start/stop
+    File file;
+    volatile bool writeFailed = false;
+};
+
+#endif /* SDRECORDER_H */
@@ -0,0 +1,141 @@
+#include "SDUpload.h"
+
+#define SD_UPLOAD_SLICE 4096 // bytes written per SD lock, bounds the stall seen by playback
+#define SD_UPLOAD_WAIT 500 // [ms] longest the web server task waits for an idle buffer
+
+typedef struct {
+  uint8_t buffer;
+  uint16_t len;
+} UploadBlock;
+
+void SDUpload::begin() {
+  writeQueue = xQueueCreate(2, sizeof(UploadBlock));
+  freeSem = xSemaphoreCreateCounting(2, 2);
+  xTaskCreatePinnedToCore(WriterTask, "SDUpload", 4096, this, 1, NULL, 0);
+}
+
+uint8_t SDUpload::open(const char* path) {
+  if (active) { error = "Upload already in progress"; return 1; }
+
+  for (uint8_t i = 0; i < 2; i++) {
+    if (!buffers[i]) buffers[i] = (uint8_t*)heap_caps_malloc(SD_UPLOAD_BUFFER_SIZE, MALLOC_CAP_DMA);
+  }
+  if (!buffers[0] || !buffers[1]) { error = "Out of memory"; return 1; }
+
+  target = path;
+  fill = 0;
+  current = 0;
+  bytesReceived = 0;
+  frames = 0;
+  maxWriteTime = 0;
+  writeFailed = false;
+  error = nullptr;
+  scanner.begin();
+
+  SDCard::lock();
+  file = SD.open(SD_UPLOAD_TMP_PATH, FILE_WRITE);
+  SDCard::unlock();
+  if (!file) { error = "Cannot create file"; return 1; }
+
+  xSemaphoreTake(freeSem, portMAX_DELAY); // producer owns the first buffer
+  owned = true;
+  active = 1;
+  return 0;
+}
+
+uint8_t SDUpload::write(const uint8_t* data, size_t len) {
+  if (!active) return 1;
+
+  if (scanner.feed(data, len)) { error = scanner.error; abort(); return 1; }
+  bytesReceived += len;
+
+  while (len > 0) {
+    size_t n = min(SD_UPLOAD_BUFFER_SIZE - fill, len);
+    memcpy(buffers[current] + fill, data, n);
+    fill += n; data += n; len -= n;
+    if (fill == SD_UPLOAD_BUFFER_SIZE && !submit()) break;
+  }
+
+  if (writeFailed) { error = "SD write failed"; abort(); return 1; }
+  return 0;
+}
+
+uint8_t SDUpload::close() {
+  if (!active) return 1;
+
+  if (fill > 0) submit();
+  drain();
+
+  if (writeFailed) error = "SD write failed";
+  else if (!scanner.complete()) error = "Truncated ILDA file";
+  frames = scanner.frames;
+
+  SDCard::lock();
+  file.close();
+  if (!error) {
+    if (SD.exists(target)) SD.remove(target);
+    if (!SD.rename(SD_UPLOAD_TMP_PATH, target)) error = "Rename failed";
+  }
+  if (error) SD.remove(SD_UPLOAD_TMP_PATH);
+  SDCard::unlock();
+
+  release();
+  return error ? 1 : 0;
+}
+
+void SDUpload::abort() {
+  if (!active) return;
+  drain();
+  SDCard::lock();
+  file.close();
+  SD.remove(SD_UPLOAD_TMP_PATH);
+  SDCard::unlock();
+  release();
+}
+
+// Hand the current buffer to the writer task and wait for the other one to become idle.
+// The caller is the web server task, a stalled card fails the upload instead of hanging it
+bool SDUpload::submit() {
+  UploadBlock block = { current, (uint16_t)fill };
+  xQueueSend(writeQueue, &block, portMAX_DELAY); // never full, the producer owned one of the two buffers
+  owned = xSemaphoreTake(freeSem, pdMS_TO_TICKS(SD_UPLOAD_WAIT)) == pdTRUE;
+  if (!owned) { writeFailed = true; return false; }
+  current ^= 1;
+  fill = 0;
+  return true;
+}
+
+// Wait until the writer task has flushed everything queued so far. After a failure the
+// writer skips the rest of each block, so this returns within one slice write
+void SDUpload::drain() {
+  for (uint8_t i = owned; i < 2; i++) xSemaphoreTake(freeSem, portMAX_DELAY);
+  for (uint8_t i = owned; i < 2; i++) xSemaphoreGive(freeSem);
+}
+
+void SDUpload::release() {
+  if (owned) xSemaphoreGive(freeSem);
+  owned = false;
+  for (uint8_t i = 0; i < 2; i++) { heap_caps_free(buffers[i]); buffers[i] = nullptr; }
+  active = 0;
+}
+
+void SDUpload::WriterTask(void* pvParameters) {
+  SDUpload* self = static_cast<SDUpload*>(pvParameters);
+  UploadBlock block;
+  while (true) {
+    if (xQueueReceive(self->writeQueue, &block, portMAX_DELAY) != pdTRUE) continue;
+    const uint8_t* data = self->buffers[block.buffer];
+    size_t offset = 0;
+    while (offset < block.len && !self->writeFailed) {
+      size_t n = min((size_t)SD_UPLOAD_SLICE, block.len - offset);
+      uint32_t t0 = micros();
+      SDCard::lock();
+      if (self->file.write(data + offset, n) != n) self->writeFailed = true;
+      SDCard::unlock();
+      uint32_t dt = micros() - t0;
+      if (dt > self->maxWriteTime) self->maxWriteTime = dt;
+      offset += n;
+    }
+    xSemaphoreGive(self->freeSem);
+  }
+}
@@ -0,0 +1,50 @@
+#ifndef SDUPLOAD_H
+#define SDUPLOAD_H
+
+#include <Arduino.h>
+#include "FS.h"
+#include "SD.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include <SDCard.h>
+#include <ILDA.h>
+
+#define SD_UPLOAD_BUFFER_SIZE 16384 // multiple of the 512 B sector size
+#define SD_UPLOAD_TMP_PATH "/upload.tmp"
+
+// Streams an upload to SD through two sector-aligned buffers. The producer (web server)
+// fills one buffer while the writer task flushes the other under the SD bus lock.
+class SDUpload {
+  public:
+    void begin();
+    uint8_t open(const char* path);
+    uint8_t write(const uint8_t* data, size_t len);
+    uint8_t close();
+    void abort();
+
+    uint8_t active = 0;
+    const char* error = nullptr;
+    uint32_t bytesReceived = 0;
+    uint32_t frames = 0;
+    uint32_t maxWriteTime = 0; // [us]
+
+  private:
+    static void WriterTask(void* pvParameters);
+    bool submit();
+    void drain();
+    void release();
+
+    uint8_t* buffers[2] = { nullptr, nullptr };
+    size_t fill = 0;
+    uint8_t current = 0;
+    bool owned = false; // producer holds one of the buffers
+    QueueHandle_t writeQueue = nullptr; // filled buffers, in file order
+    SemaphoreHandle_t freeSem = nullptr; // counts idle buffers
+    File file;
+    String target;
+    volatile bool writeFailed = false;
+    ILDAScanner scanner;
+};
+
+#endif /* SDUPLOAD_H */
@@ -0,0 +1,79 @@
+#include "UDPSocket.h"
+
+bool UDPSocket::begin(uint16_t port) {
+  fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (fd < 0) return false;
+
+  int yes = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) { close(fd); fd = -1; return false; }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+  open = true;
+  rateStart = millis();
+  return true;
+}
+
+void UDPSocket::stop() {
+  if (fd >= 0) close(fd);
+  fd = -1;
+  open = false;
+}
+
+int UDPSocket::receive(uint8_t* buf, size_t size) {
+  if (fd < 0) return -1;
+  socklen_t addrLen = sizeof(remoteAddr);
+  int len = recvfrom(fd, buf, size, MSG_TRUNC, (struct sockaddr*)&remoteAddr, &addrLen);
+  if (len < 0) return -1;
+  if ((size_t)len > size) { truncated++; len = size; } // MSG_TRUNC reports the real size
+  packets++;
+  ratePackets++;
+  return len;
+}
+
+int UDPSocket::reply(const uint8_t* buf, size_t len) { return sendTo(remoteAddr, buf, len); }
+
+int UDPSocket::sendTo(const struct sockaddr_in& to, const uint8_t* buf, size_t len) {
+  if (fd < 0) return -1;
+  return sendto(fd, buf, len, 0, (const struct sockaddr*)&to, sizeof(to));
+}
+
+void UDPSocket::processed() {
+  latency = micros() - wakeTime;
+  if (latency > maxLatency) maxLatency = latency;
+}
+
+uint8_t UDPSocket::wait(UDPSocket** sockets, uint8_t count, uint32_t timeout) {
+  fd_set readSet;
+  FD_ZERO(&readSet);
+  int maxFd = -1;
+  for (uint8_t i = 0; i < count; i++) {
+    if (sockets[i]->fd < 0) continue;
+    FD_SET(sockets[i]->fd, &readSet);
+    maxFd = max(maxFd, sockets[i]->fd);
+  }
+  if (maxFd < 0) { delay(timeout); return 0; }
+
+  struct timeval tv = { (time_t)(timeout / 1000), (suseconds_t)((timeout % 1000) * 1000) };
+  int ready = select(maxFd + 1, &readSet, nullptr, nullptr, &tv);
+
+  uint32_t now = micros();
+  uint32_t ms = millis();
+  uint8_t mask = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    UDPSocket* s = sockets[i];
+    s->wakeTime = now;
+    if (ready > 0 && s->fd >= 0 && FD_ISSET(s->fd, &readSet)) mask |= 1 << i;
+    if (ms - s->rateStart >= 1000) {
+      s->packetRate = (uint64_t)s->ratePackets * 1000 / (ms - s->rateStart);
+      if (s->packetRate > s->maxPacketRate) s->maxPacketRate = s->packetRate;
+      s->ratePackets = 0;
+      s->rateStart = ms;
+    }
+  }
+  return mask;
+}
@@ -0,0 +1,41 @@
+#ifndef UDPSOCKET_H
+#define UDPSOCKET_H
+
+#include <Arduino.h>
+#include <lwip/sockets.h>
+
+#define UDP_SOCKET_MAX 4 // sockets served by one wait()
+
+// Non-blocking lwIP datagram socket. One task blocks in wait() on all sockets at once and
+// each server drains every queued datagram per wakeup, copied once from the stack's pbufs.
+class UDPSocket {
+  public:
+    bool begin(uint16_t port);
+    void stop();
+    int receive(uint8_t* buf, size_t size); // one datagram, -1 when none is pending
+    int reply(const uint8_t* buf, size_t len); // to the sender of the last datagram
+    int sendTo(const struct sockaddr_in& to, const uint8_t* buf, size_t len);
+    const struct sockaddr_in& remote() const { return remoteAddr; }
+    void processed(); // latency bookkeeping once a datagram has been handled
+    uint32_t remoteIP() const { return remoteAddr.sin_addr.s_addr; }
+    uint16_t remotePort() const { return ntohs(remoteAddr.sin_port); }
+
+    static uint8_t wait(UDPSocket** sockets, uint8_t count, uint32_t timeout); // [ms], sockets with data as bitmask
+
+    bool open = false;
+    uint32_t packets = 0;
+    uint32_t truncated = 0; // datagrams larger than the receive buffer
+    uint32_t packetRate = 0; // [packets/s] over the last second
+    uint32_t maxPacketRate = 0;
+    uint32_t latency = 0; // [us] wakeup to handled, last datagram
+    uint32_t maxLatency = 0;
+
+  private:
+    int fd = -1;
+    struct sockaddr_in remoteAddr = {};
+    uint32_t wakeTime = 0; // [us]
+    uint32_t rateStart = 0; // [ms]
+    uint32_t ratePackets = 0;
+};
+
+#endif /* UDPSOCKET_H */
@@ -2,6 +2,7 @@
 #include <vector>
 #include <Adafruit_NeoPixel.h>
 #include <SDCard.h>
+#include <SDUpload.h>
 #include <Renderer.h>
 #include <IDNServer.h>
 #include <IWPServer.h>
@@ -18,6 +19,8 @@ using namespace std;
 Preferences preferences;
 Adafruit_NeoPixel pixels(1, PIN_LED, NEO_GRB + NEO_KHZ800);
 SDCard sd;
+SDUpload upload;
+AsyncWebServerRequest* uploader = nullptr; // request that owns upload
 Renderer renderer;
 AsyncWebServer server(80);
 File current_file;
@@ -81,12 +84,20 @@ const char index_html[] PROGMEM = R"rawliteral(
 <button onclick="playFile()">&#9654; Play</button>
 <button onclick="stopFile()">&#9209; Stop</button>
 </div>
+<div class="btn-row">
+<input type="file" id="upFile" accept=".ild,.ILD" style="flex:2">
+<button onclick="uploadFile()">&#11014; Upload</button>
+</div>
 </div>
 <div class="card">
 <div class="card-title">&#9881; Projection Settings</div>
 <div class="control-group">
-<div class="control-label"><span>Scan Period</span><span class="control-value"><span id="rateValue">10</span> &micro;s</span></div>
-<input type="range" id="scanRate" min="10" max="10000" value="10" oninput="updateSettings()">
+<div class="control-label"><span>Scan Rate</span><span class="control-value"><span id="rateValue">100000</span> pps</span></div>
+<input type="range" id="scanRate" min="100" max="100000" step="100" value="100000" oninput="updateSettings()">
+</div>
+<div class="control-group">
+<div class="control-label"><span>Frame Rate</span><span class="control-value"><span id="fpsValue">Off</span></span></div>
+<input type="range" id="fps" min="0" max="60" value="0" oninput="updateSettings()">
 </div>
 <div class="control-group">
 <div class="control-label"><span>Brightness</span><span class="control-value"><span id="brightnessValue">100</span>%</span></div>
@@ -104,12 +115,82 @@ const char index_html[] PROGMEM = R"rawliteral(
 </main>
 <footer><a href="https://stanleyprojects.com/" style="color:inherit;text-decoration:none" target="_blank" rel="noopener noreferrer">StanleyProjects</a> | VER 0.1</footer>
 <script>
-let s=null;document.addEventListener("DOMContentLoaded",()=>{document.querySelectorAll("#fileTable tr").forEach((r,i)=>{if(!i)return;r.onclick=()=>{document.querySelectorAll("#fileTable tr").forEach(x=>x.classList.remove("selected"));r.classList.add("selected");s=r.dataset.filename};r.ondblclick=()=>{s=r.dataset.filename;playFile()}})});function playFile(){if(!s){alert("Select a file.");return}fetch(`/play?file=${encodeURIComponent(s)}&rate=${document.getElementById("scanRate").value}`)}function stopFile(){fetch("/stop")}function updateSettings(){const r=document.getElementById("scanRate"),b=document.getElementById("brightness");document.getElementById("rateValue").textContent=r.value;document.getElementById("brightnessValue").textContent=b.value;fetch(`/control?rate=${r.value}&brightness=${b.value}`).catch(console.error)}function setWiFi(){fetch(`/set_wifi?ssid=${encodeURIComponent(document.getElementById("ssid").value)}&pass=${encodeURIComponent(document.getElementById("pass").value)}`)}
+let s=null;document.addEventListener("DOMContentLoaded",()=>{document.querySelectorAll("#fileTable tr").forEach((r,i)=>{if(!i)return;r.onclick=()=>{document.querySelectorAll("#fileTable tr").forEach(x=>x.classList.remove("selected"));r.classList.add("selected");s=r.dataset.filename};r.ondblclick=()=>{s=r.dataset.filename;playFile()}})});function playFile(){if(!s){alert("Select a file.");return}fetch(`/play?file=${encodeURIComponent(s)}&pps=${document.getElementById("scanRate").value}&fps=${document.getElementById("fps").value}`)}function stopFile(){fetch("/stop")}function updateSettings(){const r=document.getElementById("scanRate"),b=document.getElementById("brightness"),f=document.getElementById("fps");document.getElementById("rateValue").textContent=r.value;document.getElementById("brightnessValue").textContent=b.value;document.getElementById("fpsValue").textContent=f.value>0?f.value+" fps":"Off";fetch(`/control?pps=${r.value}&brightness=${b.value}&fps=${f.value}`).catch(console.error)}function uploadFile(){const f=document.getElementById("upFile").files[0];if(!f){alert("Choose a file.");return}const d=new FormData();d.append("file",f,f.name);fetch("/upload",{method:"POST",body:d}).then(r=>r.text().then(t=>{alert(t);if(r.ok)location.reload()})).catch(console.error)}function setWiFi(){fetch(`/set_wifi?ssid=${encodeURIComponent(document.getElementById("ssid").value)}&pass=${encodeURIComponent(document.getElementById("pass").value)}`)}
 </script>
 </body>
 </html>
 )rawliteral";
 
+String socketStats(const char* name, const UDPSocket& s) {
+  String json = "\"" + String(name) + "\":{\"packets\":" + String(s.packets);
+  json += ",\"rate\":" + String(s.packetRate);
+  json += ",\"max_rate\":" + String(s.maxPacketRate);
+  json += ",\"latency_us\":" + String(s.latency);
+  json += ",\"max_latency_us\":" + String(s.maxLatency);
+  json += ",\"truncated\":" + String(s.truncated) + "}";
+  return json;
+}
+
+// Query value as a number in lo..hi, -1 for anything else
+long queryRange(const String& value, long lo, long hi) {
+  if (value.length() == 0 || value.length() > 9) return -1;
+  for (uint8_t i = 0; i < value.length(); i++) if (!isDigit(value[i])) return -1;
+  long n = value.toInt();
+  return n >= lo && n <= hi ? n : -1;
+}
+
+// Zone id from a query value, -1 unless it is a number in 0..ZONE_MAX-1
+int zoneId(const String& value) { return queryRange(value, 0, ZONE_MAX - 1); }
+
+// Zone polygon as "x,y,x,y,..." in DAC codes
+bool setZone(uint8_t id, const String& spec) {
+  uint16_t x[ZONE_MAX_VERTICES], y[ZONE_MAX_VERTICES];
+  uint8_t n = 0;
+  const char* p = spec.c_str();
+  while (*p) {
+    char* end;
+    long vx = strtol(p, &end, 10);
+    if (end == p || *end != ',') return false;
+    p = end + 1;
+    long vy = strtol(p, &end, 10);
+    if (end == p || (*end && *end != ',') || n == ZONE_MAX_VERTICES) return false;
+    p = *end ? end + 1 : end;
+    x[n] = constrain(vx, 0L, 65535L);
+    y[n++] = constrain(vy, 0L, 65535L);
+  }
+  return renderer.zones.setZone(id, x, y, n);
+}
+
+void loadZones() {
+  preferences.begin("zones", true);
+  for (uint8_t i = 0; i < ZONE_MAX; i++) {
+    String spec = preferences.getString(("z" + String(i)).c_str(), "");
+    if (spec != "") setZone(i, spec);
+  }
+  preferences.end();
+}
+
+String zoneJson() {
+  String json = "{\"zones\":[";
+  bool first = true;
+  for (uint8_t i = 0; i < ZONE_MAX; i++) {
+    const Zone& z = renderer.zones.zone(i);
+    if (!z.vertices) continue;
+    json += String(first ? "" : ",") + "{\"id\":" + String(i) + ",\"points\":[";
+    for (uint8_t v = 0; v < z.vertices; v++) json += String(v ? "," : "") + String(z.x[v]) + "," + String(z.y[v]);
+    json += "]}";
+    first = false;
+  }
+  json += "],\"masked\":" + String(renderer.zones.masked);
+  json += ",\"exact_tests\":" + String(renderer.zones.exactTests) + "}";
+  return json;
+}
+
+// Per request error, the server frees _tempObject with the request
+void rejectUpload(AsyncWebServerRequest *request, const char* error) {
+  if (!request->_tempObject) request->_tempObject = strdup(error ? error : "Unknown error");
+}
+
 void setupServer() {
   server.on("/", HTTP_GET, [](AsyncWebServerRequest* request) {
     String page = index_html;
@@ -128,13 +209,16 @@ void setupServer() {
       renderer.change_freq(rate);
     }
 
+    if (request->hasParam("pps")) renderer.change_rate(request->getParam("pps")->value().toInt());
+
     if (request->hasParam("brightness")) {
       int brightness = request->getParam("brightness")->value().toInt();
       renderer.change_brightness(brightness);
     }
 
+    if (request->hasParam("fps")) renderer.change_fps(request->getParam("fps")->value().toInt());
+
     String file = request->getParam("file")->value();
-    int rate = request->getParam("rate")->value().toInt();
 
     renderer.sd_stop();
 
@@ -146,7 +230,7 @@ void setupServer() {
     pixels.setPixelColor(0, pixels.Color(0, 255, 0));
     pixels.show();
 
-    request->send(200, "text/plain", "Playing " + file + " at " + String(rate) + " ms");
+    request->send(200, "text/plain", "Playing " + file + " at " + String(renderer.point_rate) + " pps");
   });
 
   server.on("/stop", HTTP_GET, [](AsyncWebServerRequest *request) {
@@ -159,26 +243,415 @@ void setupServer() {
   server.on("/control", HTTP_GET, [](AsyncWebServerRequest *request) {
     bool handled = false;
 
+    // Checked before anything is applied, a rejected request changes nothing
+    long idnLatency = -1;
+    if (request->hasParam("idn_latency")) {
+      idnLatency = queryRange(request->getParam("idn_latency")->value(), JITTER_MIN_LATENCY, JITTER_LATENCY_LIMIT);
+      if (idnLatency < 0) {
+        request->send(400, "text/plain", "Need idn_latency=" + String(JITTER_MIN_LATENCY) + "-" + String(JITTER_LATENCY_LIMIT) + " [us]");
+        return;
+      }
+    }
+
     if (request->hasParam("rate")) {
       int rate = request->getParam("rate")->value().toInt();
       renderer.change_freq(rate);
       handled = true;
     }
 
+    if (request->hasParam("pps")) {
+      renderer.change_rate(request->getParam("pps")->value().toInt());
+      handled = true;
+    }
+
     if (request->hasParam("brightness")) {
       int brightness = request->getParam("brightness")->value().toInt();
       renderer.change_brightness(brightness);
       handled = true;
     }
 
+    if (request->hasParam("fps")) {
+      renderer.change_fps(request->getParam("fps")->value().toInt());
+      handled = true;
+    }
+
+    if (request->hasParam("optimize")) {
+      renderer.optimizer.enabled = request->getParam("optimize")->value().toInt() != 0;
+      handled = true;
+    }
+
+    if (request->hasParam("idn_resample")) {
+      idn.resampleEnabled = request->getParam("idn_resample")->value().toInt() != 0;
+      idn.resampler.reset();
+      handled = true;
+    }
+
+    if (request->hasParam("idn_jitter")) {
+      idn.jitterEnabled = request->getParam("idn_jitter")->value().toInt() != 0;
+      idn.jitter.reset();
+      handled = true;
+    }
+
+    if (request->hasParam("idn_latency")) {
+      idn.jitter.maxLatency = idnLatency; // [us]
+      handled = true;
+    }
+
+    if (request->hasParam("idn_arbitration")) {
+      idn.arbitration = request->getParam("idn_arbitration")->value().toInt() ? IDN_ARBITRATION_PRIORITY : IDN_ARBITRATION_FIRST_OWNER;
+      handled = true;
+    }
+
+    if (request->hasParam("idn_timeout")) {
+      idn.channelTimeout = max<long>(100, request->getParam("idn_timeout")->value().toInt()); // [ms]
+      handled = true;
+    }
+
+    for (uint8_t i = 0; i < SOURCE_COUNT; i++) {
+      String param = "prio_" + String(SourceMixer::name(i));
+      if (!request->hasParam(param.c_str())) continue;
+      renderer.mixer.priority[i] = min<long>(max<long>(request->getParam(param.c_str())->value().toInt(), 0), 255);
+      handled = true;
+    }
+
+    for (uint8_t i = 0; i < SOURCE_COUNT; i++) {
+      String param = "share_" + String(SourceMixer::name(i));
+      if (!request->hasParam(param.c_str())) continue;
+      renderer.mixer.share[i] = min<long>(max<long>(request->getParam(param.c_str())->value().toInt(), 0), 100);
+      handled = true;
+    }
+
+    if (request->hasParam("mix")) {
+      renderer.mixer.mode = request->getParam("mix")->value() == "composite" ? MIX_COMPOSITE : MIX_PRIORITY;
+      handled = true;
+    }
+
+    if (request->hasParam("mix_frame")) {
+      renderer.mixer.compositeFrame = min<long>(max<long>(request->getParam("mix_frame")->value().toInt(), 100), 60000); // [points]
+      handled = true;
+    }
+
+    if (request->hasParam("mix_transition")) {
+      renderer.mixer.transition = min<long>(max<long>(request->getParam("mix_transition")->value().toInt(), 0), 64); // [points]
+      handled = true;
+    }
+
+    if (request->hasParam("source_timeout")) {
+      renderer.mixer.timeout = max<long>(50, request->getParam("source_timeout")->value().toInt()); // [ms]
+      handled = true;
+    }
+
     if (handled) {
       String response = "Updated settings:";
       if (request->hasParam("rate")) response += " rate=" + request->getParam("rate")->value();
+      if (request->hasParam("pps")) response += " pps=" + request->getParam("pps")->value();
       if (request->hasParam("brightness")) response += " brightness=" + request->getParam("brightness")->value();
+      if (request->hasParam("fps")) response += " fps=" + request->getParam("fps")->value();
+      if (request->hasParam("idn_resample")) response += " idn_resample=" + request->getParam("idn_resample")->value();
+      if (request->hasParam("idn_jitter")) response += " idn_jitter=" + request->getParam("idn_jitter")->value();
+      if (request->hasParam("idn_latency")) response += " idn_latency=" + request->getParam("idn_latency")->value();
+      if (request->hasParam("idn_arbitration")) response += " idn_arbitration=" + request->getParam("idn_arbitration")->value();
+      if (request->hasParam("idn_timeout")) response += " idn_timeout=" + request->getParam("idn_timeout")->value();
+      for (uint8_t i = 0; i < SOURCE_COUNT; i++) {
+        String param = "prio_" + String(SourceMixer::name(i));
+        if (request->hasParam(param.c_str())) response += " " + param + "=" + request->getParam(param.c_str())->value();
+        param = "share_" + String(SourceMixer::name(i));
+        if (request->hasParam(param.c_str())) response += " " + param + "=" + request->getParam(param.c_str())->value();
+      }
+      if (request->hasParam("mix")) response += " mix=" + request->getParam("mix")->value();
+      if (request->hasParam("mix_frame")) response += " mix_frame=" + request->getParam("mix_frame")->value();
+      if (request->hasParam("mix_transition")) response += " mix_transition=" + request->getParam("mix_transition")->value();
+      if (request->hasParam("source_timeout")) response += " source_timeout=" + request->getParam("source_timeout")->value();
       request->send(200, "text/plain", response);
     } else request->send(400, "text/plain", "No valid parameters provided");
   });
 
+  // One upload at a time; the request that owns it is tracked so a second POST cannot touch it
+  server.on("/upload", HTTP_POST, [](AsyncWebServerRequest *request) {
+    if (request->_tempObject) request->send(400, "text/plain", String("Upload failed: ") + (const char*)request->_tempObject);
+    else if (uploader != request) request->send(400, "text/plain", "Upload failed: No file");
+    else {
+      uploader = nullptr;
+      request->send(200, "text/plain", "Uploaded " + String(upload.bytesReceived) + " bytes, " + String(upload.frames) + " frames");
+    }
+  }, [](AsyncWebServerRequest *request, const String& filename, size_t index, uint8_t *data, size_t len, bool final) {
+    if (index == 0) {
+      String path = "/" + filename;
+      if (upload.active) { rejectUpload(request, "Upload already in progress"); return; }
+      if (!filename.endsWith(".ild") && !filename.endsWith(".ILD")) { rejectUpload(request, "Not an .ild file"); return; }
+      if (filename.indexOf('/') >= 0 || filename.indexOf("..") >= 0) { rejectUpload(request, "Invalid file name"); return; }
+      if (renderer.sdRunning && path == current_file.path()) { rejectUpload(request, "File is playing"); return; }
+      if (upload.open(path.c_str())) { rejectUpload(request, upload.error); return; }
+      uploader = request;
+      request->onDisconnect([request]() {
+        if (uploader != request) return;
+        upload.abort(); // client went away mid body, drop the temp file
+        uploader = nullptr;
+      });
+    }
+    if (uploader != request || !upload.active) return; // rejected or aborted, discard the rest of the body
+    if (upload.write(data, len)) { rejectUpload(request, upload.error); return; }
+    if (final && upload.close()) rejectUpload(request, upload.error);
+  });
+
+  // /zones?set=ID&points=x,y,x,y,... | /zones?clear=ID|all, blanking polygons kept across reboots
+  server.on("/zones", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (request->hasParam("set")) {
+      int id = zoneId(request->getParam("set")->value());
+      String spec = request->hasParam("points") ? request->getParam("points")->value() : "";
+      if (id < 0 || !setZone(id, spec)) {
+        request->send(400, "text/plain", "Need set=0-" + String(ZONE_MAX - 1) + " and 3-" + String(ZONE_MAX_VERTICES) + " points=x,y,...");
+        return;
+      }
+      preferences.begin("zones", false);
+      preferences.putString(("z" + String(id)).c_str(), spec);
+      preferences.end();
+    }
+    if (request->hasParam("clear")) {
+      String which = request->getParam("clear")->value();
+      int id = which == "all" ? -1 : zoneId(which);
+      if (which != "all" && id < 0) {
+        request->send(400, "text/plain", "Need clear=0-" + String(ZONE_MAX - 1) + " or clear=all");
+        return;
+      }
+      preferences.begin("zones", false);
+      for (uint8_t i = 0; i < ZONE_MAX; i++) {
+        if (id >= 0 && id != i) continue;
+        renderer.zones.clearZone(i);
+        preferences.remove(("z" + String(i)).c_str());
+      }
+      preferences.end();
+    }
+    request->send(200, "application/json", zoneJson());
+  });
+
+  // /pattern?type=circle&size=50&points=1000&fa=3&fb=2&phase=64&r=255&g=0&b=0, omitted values are kept
+  // /pattern?text=HELLO&scroll=300 shows text, scroll in 1/32768 of half the range per cycle
+  server.on("/pattern", HTTP_GET, [](AsyncWebServerRequest *request) {
+    PatternParams p = renderer.generator.get();
+    if (request->hasParam("type")) {
+      String type = request->getParam("type")->value();
+      uint8_t t = 0;
+      while (t < PATTERN_COUNT && type != PatternGenerator::name(t)) t++;
+      if (t == PATTERN_COUNT) { request->send(400, "text/plain", "Unknown pattern type"); return; }
+      p.type = t;
+    }
+    if (request->hasParam("size")) p.size = request->getParam("size")->value().toInt();
+    if (request->hasParam("points")) p.points = request->getParam("points")->value().toInt();
+    if (request->hasParam("fa")) p.fa = request->getParam("fa")->value().toInt();
+    if (request->hasParam("fb")) p.fb = request->getParam("fb")->value().toInt();
+    if (request->hasParam("phase")) p.phase = request->getParam("phase")->value().toInt();
+    if (request->hasParam("r")) p.r = request->getParam("r")->value().toInt();
+    if (request->hasParam("g")) p.g = request->getParam("g")->value().toInt();
+    if (request->hasParam("b")) p.b = request->getParam("b")->value().toInt();
+    if (request->hasParam("text") || request->hasParam("scroll")) {
+      char text[TEXT_MAX + 1];
+      int16_t scroll;
+      renderer.generator.text.get(text, scroll);
+      if (request->hasParam("scroll")) scroll = request->getParam("scroll")->value().toInt();
+      if (request->hasParam("text")) {
+        renderer.generator.text.set(request->getParam("text")->value().c_str(), scroll);
+        if (!request->hasParam("type")) p.type = PATTERN_TEXT;
+      }
+      else renderer.generator.text.set(text, scroll);
+    }
+    renderer.generator.set(p);
+    if (p.type != PATTERN_OFF && renderer.rendererRunning == 0) renderer.start();
+
+    p = renderer.generator.get();
+    String json = "{\"type\":\"" + String(PatternGenerator::name(p.type)) + "\"";
+    json += ",\"size\":" + String(p.size);
+    json += ",\"points\":" + String(p.points);
+    json += ",\"fa\":" + String(p.fa);
+    json += ",\"fb\":" + String(p.fb);
+    json += ",\"phase\":" + String(p.phase);
+    json += ",\"r\":" + String(p.r) + ",\"g\":" + String(p.g) + ",\"b\":" + String(p.b);
+    char text[TEXT_MAX + 1];
+    int16_t scroll;
+    renderer.generator.text.get(text, scroll);
+    String escaped = text;
+    escaped.replace("\\", "\\\\");
+    escaped.replace("\"", "\\\"");
+    json += ",\"text\":\"" + escaped + "\",\"scroll\":" + String(scroll);
+    json += ",\"cycles\":" + String(renderer.generator.cycles) + "}";
+    request->send(200, "application/json", json);
+  });
+
+  // /projection?enable=1&rx=0&ry=30&rz=0&tx=0&ty=0&tz=0&distance=65536, omitted values are kept
+  server.on("/projection", HTTP_GET, [](AsyncWebServerRequest *request) {
+    ProjectionParams p = renderer.projection().get();
+    if (request->hasParam("enable")) p.enabled = request->getParam("enable")->value().toInt() != 0;
+    if (request->hasParam("rx")) p.rx = request->getParam("rx")->value().toInt();
+    if (request->hasParam("ry")) p.ry = request->getParam("ry")->value().toInt();
+    if (request->hasParam("rz")) p.rz = request->getParam("rz")->value().toInt();
+    if (request->hasParam("tx")) p.tx = request->getParam("tx")->value().toInt();
+    if (request->hasParam("ty")) p.ty = request->getParam("ty")->value().toInt();
+    if (request->hasParam("tz")) p.tz = request->getParam("tz")->value().toInt();
+    if (request->hasParam("distance")) p.distance = request->getParam("distance")->value().toInt();
+    renderer.projection().set(p);
+    renderer.optimizer.reset(); // cached orders were made for the old geometry
+
+    p = renderer.projection().get();
+    String json = "{\"enabled\":" + String(p.enabled ? "true" : "false");
+    json += ",\"rx\":" + String(p.rx) + ",\"ry\":" + String(p.ry) + ",\"rz\":" + String(p.rz);
+    json += ",\"tx\":" + String(p.tx) + ",\"ty\":" + String(p.ty) + ",\"tz\":" + String(p.tz);
+    json += ",\"distance\":" + String(p.distance);
+    json += ",\"clipped\":" + String(renderer.projection().clipped) + "}";
+    request->send(200, "application/json", json);
+  });
+
+  // /record?start=/rec.ild&source=idn|iwp&split=marker|time&slice=33 | /record?stop=1 | /record
+  server.on("/record", HTTP_GET, [](AsyncWebServerRequest *request) {
+    SDRecorder& rec = renderer.recorder;
+    if (request->hasParam("start")) {
+      String source = request->hasParam("source") ? request->getParam("source")->value() : "idn";
+      if (source != "idn" && source != "iwp") { request->send(400, "text/plain", "Unknown source"); return; }
+      uint8_t split = RECORD_SPLIT_MARKER;
+      if (request->hasParam("split") && request->getParam("split")->value() == "time") split = RECORD_SPLIT_TIME;
+      uint16_t slice = request->hasParam("slice") ? request->getParam("slice")->value().toInt() : SD_RECORD_SLICE;
+      if (rec.start(request->getParam("start")->value().c_str(), source == "iwp" ? SOURCE_IWP : SOURCE_IDN, split, slice)) {
+        request->send(500, "text/plain", rec.error);
+        return;
+      }
+    }
+    else if (request->hasParam("stop") && rec.stop()) {
+      request->send(500, "text/plain", rec.error);
+      return;
+    }
+
+    String json = "{\"active\":" + String(rec.active ? "true" : "false");
+    json += ",\"source\":\"" + String(SourceMixer::name(rec.source)) + "\"";
+    json += ",\"split\":\"" + String(rec.split == RECORD_SPLIT_TIME ? "time" : "marker") + "\"";
+    json += ",\"frames\":" + String(rec.frames);
+    json += ",\"points\":" + String(rec.points);
+    json += ",\"dropped_frames\":" + String(rec.droppedFrames);
+    json += ",\"dropped_points\":" + String(rec.droppedPoints);
+    json += ",\"bytes\":" + String(rec.bytesWritten);
+    json += ",\"max_write_us\":" + String(rec.maxWriteTime) + "}";
+    request->send(200, "application/json", json);
+  });
+
+  // /trace?arm=1&decimation=1&post=10&underrun=1 | /trace?trigger=1 | /trace?disable=1 | /trace
+  server.on("/trace", HTTP_GET, [](AsyncWebServerRequest *request) {
+    TraceCapture& trace = renderer.trace;
+    if (request->hasParam("arm")) {
+      if (trace.exports) { request->send(409, "text/plain", "Trace export in progress"); return; }
+      uint16_t decimation = request->hasParam("decimation") ? request->getParam("decimation")->value().toInt() : 1;
+      uint8_t post = request->hasParam("post") ? request->getParam("post")->value().toInt() : TRACE_POST;
+      bool underrun = !request->hasParam("underrun") || request->getParam("underrun")->value().toInt() != 0;
+      if (!trace.arm(decimation, post, underrun)) { request->send(500, "text/plain", "Out of memory"); return; }
+    }
+    else if (request->hasParam("trigger")) trace.trigger(TRACE_MANUAL);
+    else if (request->hasParam("disable")) trace.disable();
+
+    static const char* causes[] = { "none", "underrun", "manual" };
+    String json = "{\"armed\":" + String(trace.armed ? "true" : "false");
+    json += ",\"cause\":\"" + String(causes[trace.cause]) + "\"";
+    json += ",\"decimation\":" + String(trace.decimation);
+    json += ",\"post\":" + String(trace.post);
+    json += ",\"underrun\":" + String(trace.triggerOnUnderrun ? "true" : "false");
+    json += ",\"samples\":" + String(trace.samples()) + "}";
+    request->send(200, "application/json", json);
+  });
+
+  // Binary export of a stopped trace, see TraceHeader
+  server.on("/trace.bin", HTTP_GET, [](AsyncWebServerRequest *request) {
+    size_t size = renderer.trace.exportSize(renderer.point_rate);
+    if (size == 0) { request->send(409, "text/plain", "Trace running or empty, trigger or disable it first"); return; }
+    renderer.trace.exports++;
+    request->onDisconnect([]() { renderer.trace.exports--; });
+    request->send(request->beginResponse("application/octet-stream", size, [](uint8_t* buf, size_t maxLen, size_t index) -> size_t {
+      return renderer.trace.exportRead(buf, maxLen, index);
+    }));
+  });
+
+  server.on("/stats", HTTP_GET, [](AsyncWebServerRequest *request) {
+    String json = "{";
+    json += "\"pps\":" + String(renderer.point_rate) + ",";
+    uint32_t mixed = renderer.mixer.blankPoints;
+    for (uint8_t i = 0; i < SOURCE_COUNT; i++) mixed += renderer.mixer.points[i];
+    json += "\"sources\":{\"mode\":\"" + String(renderer.mixer.mode == MIX_COMPOSITE ? "composite" : "priority") + "\"";
+    json += ",\"active\":\"" + String(SourceMixer::name(renderer.mixer.active)) + "\"";
+    json += ",\"switches\":" + String(renderer.mixer.switches);
+    json += ",\"forced_switches\":" + String(renderer.mixer.forcedSwitches);
+    json += ",\"blank_points\":" + String(renderer.mixer.blankPoints);
+    for (uint8_t i = 0; i < SOURCE_COUNT; i++) {
+      json += ",\"" + String(SourceMixer::name(i)) + "\":{\"priority\":" + String(renderer.mixer.priority[i]);
+      json += ",\"share\":" + String(renderer.mixer.share[i]);
+      json += ",\"output_share\":" + String(mixed ? 100.0f * renderer.mixer.points[i] / mixed : 0.0f, 1);
+      json += ",\"fill\":" + String(renderer.buffer_fill(i));
+      json += ",\"capacity\":" + String(renderer.buffer_capacity(i));
+      json += ",\"points\":" + String(renderer.mixer.points[i]);
+      json += ",\"dropped\":" + String(renderer.buffer_dropped(i));
+      json += ",\"underruns\":" + String(renderer.buffer_underruns(i)) + "}";
+    }
+    json += "},";
+    json += "\"sd\":{\"readahead\":" + String(renderer.reader.depth);
+    json += ",\"ready\":" + String(renderer.reader.ready());
+    json += ",\"reads\":" + String(renderer.reader.blocksRead);
+    json += ",\"last_read_us\":" + String(renderer.reader.lastReadLatency);
+    json += ",\"max_read_us\":" + String(renderer.reader.maxReadLatency);
+    json += ",\"max_write_us\":" + String(upload.maxWriteTime);
+    json += ",\"record_dropped_frames\":" + String(renderer.recorder.droppedFrames);
+    json += ",\"record_dropped_points\":" + String(renderer.recorder.droppedPoints);
+    json += ",\"frame\":" + String(renderer.frame_index);
+    json += ",\"fps_target\":" + String(renderer.target_fps);
+    json += ",\"fps\":" + String(renderer.fps_measured, 2);
+    json += ",\"fps_accuracy\":" + String(renderer.target_fps ? 100.0f * renderer.fps_measured / renderer.target_fps : 0.0f, 2);
+    json += ",\"optimize\":{\"enabled\":" + String(renderer.optimizer.enabled ? "true" : "false");
+    json += ",\"frames\":" + String(renderer.optimizer.frames);
+    json += ",\"cache_hits\":" + String(renderer.optimizer.cacheHits);
+    json += ",\"travel_before\":" + String(renderer.optimizer.travelBefore / 65535.0f, 1); // full scale widths
+    json += ",\"travel_after\":" + String(renderer.optimizer.travelAfter / 65535.0f, 1);
+    json += ",\"points_saved\":" + String(renderer.optimizer.pointsSaved) + "}}";
+    json += ",\"idn\":{\"resample\":" + String(idn.resampleEnabled ? "true" : "false");
+    json += ",\"rate_in\":" + String(idn.resampler.inputRate, 1);
+    json += ",\"bypass\":" + String(idn.resampler.bypass ? "true" : "false");
+    json += ",\"latency_us\":" + String(idn.jitter.latency);
+    json += ",\"latency_max_us\":" + String(idn.jitter.maxLatency);
+    json += ",\"jitter_us\":" + String(idn.jitter.jitter);
+    json += ",\"late_chunks\":" + String(idn.jitter.lateChunks);
+    json += ",\"late_points\":" + String(idn.jitter.latePoints);
+    json += ",\"gap_points\":" + String(idn.jitter.gapPoints);
+    json += ",\"config_mismatch\":" + String(idn.configMismatch);
+    json += ",\"channel\":" + String(idn.activeChannel);
+    json += ",\"switches\":" + String(idn.channelSwitches);
+    json += ",\"lost\":" + String(idn.packetsLost);
+    json += ",\"reordered\":" + String(idn.packetsReordered);
+    json += ",\"rejected\":" + String(idn.packetsRejected);
+    json += ",\"malformed\":" + String(idn.malformed);
+    json += ",\"decode_cycles\":" + String(idn.decodeCycles, 1);
+    json += ",\"frame_mode\":" + String(idn.frameMode ? "true" : "false");
+    json += ",\"frames\":" + String(idn.frame.frames);
+    json += ",\"frames_aborted\":" + String(idn.frame.aborted);
+    json += ",\"frame_truncated\":" + String(idn.frame.truncated) + "}";
+    json += ",\"cache\":{\"entries\":" + String(iwp.cache.entries);
+    json += ",\"bytes\":" + String(iwp.cache.bytesUsed);
+    json += ",\"budget\":" + String(iwp.cache.budget);
+    json += ",\"hits\":" + String(iwp.cache.hits);
+    json += ",\"misses\":" + String(iwp.cache.misses);
+    json += ",\"evictions\":" + String(iwp.cache.evictions) + "}";
+    json += ",\"net\":{" + socketStats("idn", idn.udp) + "," + socketStats("iwp", iwp.udp) + "}";
+    json += ",\"iwp\":{\"udp_points\":" + String(iwp.pathStats[IWP_SOURCE_UDP].points);
+    json += ",\"udp_cycles\":" + String(iwp.pathStats[IWP_SOURCE_UDP].cycles, 1);
+    json += ",\"tcp_points\":" + String(iwp.pathStats[IWP_SOURCE_TCP].points);
+    json += ",\"tcp_cycles\":" + String(iwp.pathStats[IWP_SOURCE_TCP].cycles, 1);
+    json += ",\"tcp_connected\":" + String(iwp.stream.connected() ? "true" : "false");
+    json += ",\"tcp_connections\":" + String(iwp.stream.connections);
+    json += ",\"tcp_rejected\":" + String(iwp.stream.rejected);
+    json += ",\"tcp_bytes\":" + String(iwp.stream.bytesIn);
+    json += ",\"tcp_overflows\":" + String(iwp.stream.overflows);
+    json += ",\"tcp_errors\":" + String(iwp.streamErrors);
+    json += ",\"serial_points\":" + String(iwp.pathStats[IWP_SOURCE_SERIAL].points);
+    json += ",\"serial_cycles\":" + String(iwp.pathStats[IWP_SOURCE_SERIAL].cycles, 1);
+    json += ",\"serial_bytes\":" + String(iwp.serial.bytesIn);
+    json += ",\"serial_resyncs\":" + String(iwp.serial.resyncs);
+    json += ",\"serial_overflows\":" + String(iwp.serial.overflows);
+    json += ",\"serial_discarded\":" + String(iwp.serial.discarded) + "}";
+    json += "}";
+    request->send(200, "application/json", json);
+  });
+
   server.on("/set_wifi", HTTP_GET, [](AsyncWebServerRequest *request) {
     if (!request->hasParam("ssid") || !request->hasParam("pass")) {
       request->send(400, "text/plain", "Missing ssid or pass parameter");
@@ -202,15 +675,20 @@ void setupServer() {
   server.begin();
 }
 
+// Sleeps until a datagram arrives on either port; the short timeout while an IDN frame is
+// repeated or an IWP TCP client is connected keeps those going, the long one still runs
+// the channel timeouts
 void udp_loop(void* pvParameters) {
+  UDPSocket* sockets[] = { &idn.udp, &iwp.udp };
   while(1) {
+    UDPSocket::wait(sockets, 2, iwp.nextTimeout(idn.frameMode ? 2 : 20));
     idn.loop();
     iwp.loop();
-    vTaskDelay(pdMS_TO_TICKS(1));
   }
 }
 
 void setup() {
+  Serial.setRxBufferSize(IWP_SERIAL_RX_BUFFER);
   Serial.begin(115200);
   // while(!Serial.availableForWrite()){}
 
@@ -225,14 +703,22 @@ void setup() {
   esp_wifi_set_ps(WIFI_PS_NONE);
   sd.begin();
   sd.mount();
+  upload.begin();
   idn.begin();
   idn.setRendererHandle(&renderer);
   iwp.begin();
   iwp.setRendererHandle(&renderer);
 
   renderer.begin();
+  loadZones();
   renderer.start();
 
+  iwp.serial.begin(Serial, &iwp);
+#if ARDUINO_USB_MODE && ARDUINO_USB_CDC_ON_BOOT
+  Serial.onEvent(ARDUINO_HW_CDC_RX_EVENT, [](void*, esp_event_base_t, int32_t, void*) { iwp.serial.notify(); });
+  Serial.onEvent(ARDUINO_HW_CDC_RX_OVERFLOW_EVENT, [](void*, esp_event_base_t, int32_t, void*) { iwp.serial.overflow(); });
+#endif
+
   xTaskCreatePinnedToCore (udp_loop, "udp_loop", 8192, NULL, 2, NULL, 0);
 
   setupServer();
@@ -6,10 +6,13 @@
 
 # Usage:
 # python iwp-ilda.py --file "animation.ild" --ip 192.168.1.123 --scan 1000 --repeat 0
+# python iwp-ilda.py --file "animation.ild" --ip 192.168.1.123 --scan 30000 --pace 20
 # E.g.: python iwp-ilda.py --file "anim1.ild" --ip 192.168.1.142 --scan 100000 --fps 0 --repeat 100
 
 from __future__ import annotations
 import argparse
+import os
+import select
 import socket
 import struct
 import sys
@@ -24,6 +27,24 @@ IW_TYPE_0 = 0x00  # Turn off / end frame
 IW_TYPE_1 = 0x01  # Period (us)
 IW_TYPE_2 = 0x02  # 16b X/Y + 8b R/G/B
 IW_TYPE_3 = 0x03  # 16b X/Y + 16b R/G/B
+IW_TYPE_4 = 0x04  # Point rate (pps)
+IW_TYPE_5 = 0x05  # Status request
+IW_TYPE_6 = 0x06  # Delta coded point run
+IW_TYPE_7 = 0x07  # Store frame in cache
+IW_TYPE_8 = 0x08  # Play cached frame
+IW_TYPE_MISS = 0x88  # Cache miss reply
+IW_TYPE_STATUS = 0x85  # Status reply
+
+IW_STATUS_OFF = 0x00
+IW_STATUS_ONCE = 0x01
+IW_STATUS_PACKET = 0x02
+IW_STATUS_PERIODIC = 0x03
+
+IW_OP_DELTA = 0x00
+IW_OP_COLOR = 0x40
+IW_OP_BLANK = 0x80
+IW_OP_DWELL = 0xC0
+IW_OP_MAX_COUNT = 64
 
 # ------------------------
 # ILDA structures / helpers
@@ -160,17 +181,209 @@ def parse_ilda(filename: str) -> Tuple[List[IldaFrame], List[Tuple[int, int, int
     return frames, palette
 
 
+# ------------------------
+# IWP TYPE_6 encoder
+# ------------------------
+def _varint(v: int) -> bytes:
+    u = (v << 1) ^ (v >> 31)  # zigzag
+    u &= 0xFFFFFFFF
+    out = bytearray()
+    while True:
+        b = u & 0x7F
+        u >>= 7
+        if u:
+            out.append(b | 0x80)
+        else:
+            out.append(b)
+            return bytes(out)
+
+
+def _delta16(a: int, b: int) -> int:
+    return ((b - a + 0x8000) & 0xFFFF) - 0x8000
+
+
+def encode_runs(samples: List[Tuple[int, int, int, int, int, bool]], max_packet_size: int) -> List[bytes]:
+    """Pack (x16, y16, r8, g8, b8, blanked) samples into TYPE_6 records, one per packet."""
+    packets: List[bytes] = []
+    i = 0
+    prev = None  # position of the last emitted sample
+    while i < len(samples):
+        start = prev if prev else (samples[i][0], samples[i][1])
+        px, py = start
+        color = (0, 0, 0)
+        body = bytearray()
+        last = None
+        limit = max_packet_size - 7
+        while i < len(samples):
+            x, y, r, g, b, blanked = samples[i]
+            c = (r, g, b)
+            if last is not None and (x, y) == (last[0], last[1]) and blanked == last[3] and (blanked or c == last[2]):
+                # Dwell: extend a trailing DWELL op or start one
+                n = 1
+                while i + n < len(samples) and n < IW_OP_MAX_COUNT and samples[i + n] == samples[i]:
+                    n += 1
+                if len(body) + 1 > limit:
+                    break
+                body.append(IW_OP_DWELL | (n - 1))
+                i += n
+                continue
+
+            op = bytearray()
+            if not blanked and c != color:
+                op += bytes([IW_OP_COLOR]) + bytes(c)
+            kind = IW_OP_BLANK if blanked else IW_OP_DELTA
+            # Run of points sharing kind and color
+            run = bytearray()
+            n = 0
+            cx, cy = px, py
+            while i + n < len(samples) and n < IW_OP_MAX_COUNT:
+                x2, y2, r2, g2, b2, bl2 = samples[i + n]
+                if bl2 != blanked or (not blanked and (r2, g2, b2) != c):
+                    break
+                if n > 0 and (x2, y2) == (cx, cy):
+                    break  # leave repeats to DWELL
+                enc = _varint(_delta16(cx, x2)) + _varint(_delta16(cy, y2))
+                if len(body) + len(op) + 1 + len(run) + len(enc) > limit:
+                    break
+                run += enc
+                cx, cy = x2, y2
+                n += 1
+            if n == 0:
+                break
+            body += op + bytes([kind | (n - 1)]) + run
+            if not blanked:
+                color = c
+            px, py = cx, cy
+            last = (cx, cy, c, blanked)
+            i += n
+        if not body:
+            break
+        packets.append(struct.pack(">B H H H", IW_TYPE_6, len(body), start[0], start[1]) + bytes(body))
+        prev = (px, py)
+    return packets
+
+
 # ------------------------
 # UDP sender
 # ------------------------
+@dataclass
+class DeviceStatus:
+    fill: int
+    free: int
+    rate: int
+    underruns: int
+    dropped: int
+
+
 class ProjectorSender:
-    def __init__(self, ip: str, scan_rate: int = 1000, point_delay: float = 0.0):
+    def __init__(self, ip: str, scan_rate: int = 1000, point_delay: float = 0.0, pace_ms: float = 0.0, tcp: bool = False, serial: Optional[str] = None):
         self.ip = ip
-        self.port = 7200   
-        self.scan_period = max(1, min(4294967295, int(1000000/int(scan_rate))))
+        self.port = 7201 if tcp else 7200
+        self.scan_rate = max(1, min(4294967295, int(scan_rate)))
         self.point_delay = point_delay
-        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
-        self.sock.sendto(struct.pack(">B I", IW_TYPE_1, self.scan_period), (self.ip, self.port))
+        self.pace_ms = pace_ms
+        self.tcp = tcp
+        self.points_sent = 0
+        self.status: Optional[DeviceStatus] = None
+        self.misses: List[int] = []
+        self.rx = bytearray()
+        self.fd: Optional[int] = None
+        if serial:
+            # USB CDC or any tty, e.g. a pty standing in for the device; the baud rate is ignored by CDC
+            import termios
+            import tty
+            self.fd = os.open(serial, os.O_RDWR | os.O_NOCTTY)
+            tty.setraw(self.fd)
+            termios.tcflush(self.fd, termios.TCIOFLUSH)
+            self.sock = None
+        elif tcp:
+            # The device acknowledges records as it queues them, sendall() blocks while it is full
+            self.sock = socket.create_connection((self.ip, self.port))
+            self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        else:
+            self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self._send(struct.pack(">B I", IW_TYPE_4, self.scan_rate))
+        if self.pace_ms > 0:
+            self._send(struct.pack(">B B H", IW_TYPE_5, IW_STATUS_PACKET, 0))
+
+    def _send(self, data: bytes):
+        if self.fd is not None:
+            view = memoryview(data)
+            while view:
+                view = view[os.write(self.fd, view):]
+        elif self.tcp:
+            self.sock.sendall(data)
+        else:
+            self.sock.sendto(data, (self.ip, self.port))
+
+    def _recv_stream(self, timeout: float) -> bytes:
+        if self.fd is None:
+            chunk = self.sock.recv(256)
+            if not chunk:
+                raise ConnectionError("device closed the connection")
+            return chunk
+        if not select.select([self.fd], [], [], timeout)[0]:
+            raise socket.timeout()
+        return os.read(self.fd, 256)
+
+    def _recv_reply(self, timeout: float) -> Optional[bytes]:
+        if self.sock:
+            self.sock.settimeout(timeout)
+        if not self.tcp and self.fd is None:
+            data, _ = self.sock.recvfrom(64)
+            return data
+        # Replies arrive back to back; on serial, debug text from the device is skipped
+        while True:
+            while self.rx and self.rx[0] not in (IW_TYPE_STATUS, IW_TYPE_MISS):
+                del self.rx[:1]
+            if self.rx:
+                size = 17 if self.rx[0] == IW_TYPE_STATUS else 3
+                if len(self.rx) >= size:
+                    data = bytes(self.rx[:size])
+                    del self.rx[:size]
+                    return data
+            self.rx += self._recv_stream(timeout)
+
+    def _read_status(self, timeout: float) -> bool:
+        try:
+            data = self._recv_reply(timeout)
+        except (socket.timeout, BlockingIOError):
+            return False
+        if data is None:
+            return False
+        if len(data) >= 3 and data[0] == IW_TYPE_MISS:
+            self.misses.append(struct.unpack(">H", data[1:3])[0])
+            return True
+        if len(data) >= 17 and data[0] == IW_TYPE_STATUS:
+            self.status = DeviceStatus(*struct.unpack(">HHIII", data[1:17]))
+            return True
+        return False
+
+    def store_frame(self, frame_id: int, points: List[Tuple[int, int, int, int, int, int, int]]):
+        per_packet = (1023 - 7) // 11
+        samples = self.frame_samples(points)
+        for i in range(0, len(samples), per_packet):
+            pkt = bytearray(struct.pack(">B H H H", IW_TYPE_7, frame_id, len(samples), i))
+            for (x16, y16, r8, g8, b8, blanked) in samples[i:i + per_packet]:
+                c = (0, 0, 0) if blanked else (r8 * 257, g8 * 257, b8 * 257)
+                pkt += struct.pack(">B H H H H H", IW_TYPE_3, x16, y16, *c)
+            self._send(bytes(pkt))
+            if not self.tcp and self.fd is None:
+                time.sleep(0.001)  # uploads are not paced by the device
+
+    def play_frame(self, frame_id: int, repeat: int = 1):
+        self._send(struct.pack(">B H H", IW_TYPE_8, frame_id, repeat))
+
+    def _pace(self, points: int):
+        # Closed loop: keep about pace_ms of points queued on the device
+        target = self.scan_rate * self.pace_ms / 1000
+        while True:
+            while self._read_status(0):
+                pass
+            if self.status is None or self.status.fill + points <= max(target, points):
+                return
+            if not self._read_status(0.005):
+                self._send(struct.pack(">B B H", IW_TYPE_5, IW_STATUS_ONCE, 0))
 
     @staticmethod
     def _u16(x: int) -> int:
@@ -185,6 +398,25 @@ class ProjectorSender:
         yn = (-y + 0x8000)
         return self._u16(xn), self._u16(yn)
 
+    def frame_samples(self, points: List[Tuple[int, int, int, int, int, int, int]]) -> List[Tuple[int, int, int, int, int, bool]]:
+        samples = []
+        for (x, y, _z, status, r8, g8, b8) in points:
+            blanked = (status & STATUS_BLANKED_MASK) != 0
+            x16, y16 = self._transform_xy(x, y)
+            samples.append((x16, y16, r8, g8, b8, blanked))
+        return samples
+
+    def send_frame_compressed(self, points: List[Tuple[int, int, int, int, int, int, int]]):
+        samples = self.frame_samples(points)
+        packets = encode_runs(samples, 1023)
+        for i, chunk in enumerate(packets):
+            if self.pace_ms > 0:
+                self._pace(len(samples) // len(packets) + 1)
+            self._send(chunk)
+            if self.point_delay > 0:
+                time.sleep(self.point_delay)
+        self.points_sent += len(samples)
+
     def send_frame(self, points: List[Tuple[int, int, int, int, int, int, int]]):
         max_packet_size = 1023
         point_size = struct.calcsize(">B H H H H H")  # 11 bytes
@@ -212,17 +444,50 @@ class ProjectorSender:
         for i in range(0, len(samples), max_points_per_packet):
             chunk = b"".join(samples[i:i + max_points_per_packet])
             if chunk:
-                self.sock.sendto(chunk, (self.ip, self.port))
+                if self.pace_ms > 0:
+                    self._pace(len(chunk) // point_size)
+                self._send(chunk)
                 if self.point_delay > 0:
                     time.sleep(self.point_delay)
+        self.points_sent += len(samples)
+
+def measure(frames: List[IldaFrame], scan: int):
+    """Print IWP payload size per encoding for the parsed file, nothing is sent."""
+    sender = ProjectorSender.__new__(ProjectorSender)
+    points = 0
+    sizes = {"TYPE_3": 0, "TYPE_2": 0, "TYPE_6": 0}
+    packets = {"TYPE_3": 0, "TYPE_2": 0, "TYPE_6": 0}
+    for fr in frames:
+        n = len(fr.points)
+        points += n
+        for name, size in (("TYPE_3", 11), ("TYPE_2", 8)):
+            per_packet = 1023 // size
+            sizes[name] += n * size
+            packets[name] += (n + per_packet - 1) // per_packet
+        runs = encode_runs(sender.frame_samples(fr.points), 1023)
+        sizes["TYPE_6"] += sum(len(p) for p in runs)
+        packets["TYPE_6"] += len(runs)
+    if points == 0:
+        return
+    for name in sizes:
+        per_point = sizes[name] / points
+        mbit = (sizes[name] + packets[name] * 28) * 8 * scan / points / 1e6  # with IPv4/UDP headers
+        print(f"{name}: {per_point:5.2f} B/point, {mbit:5.2f} Mbit/s at {scan} pps, {100 * sizes[name] / sizes['TYPE_3']:5.1f} %")
+
 
 def main():
     ap = argparse.ArgumentParser(description="ILDA to IWP Sender")
     ap.add_argument("--file", required=True, help="Path to ILDA .ild file")
-    ap.add_argument("--ip", required=True, help="Projector IP")
+    ap.add_argument("--ip", help="Projector IP")
     ap.add_argument("--scan", type=int, default=1000, help="Scan rate in Hz")
     ap.add_argument("--fps", type=float, default=0, help="Frame rate. If >0, used to time points; else send as fast as possible.")
     ap.add_argument("--repeat", type=int, default=1, help="How many times to play the file. 0 = infinite")
+    ap.add_argument("--compress", action="store_true", help="Send delta coded TYPE_6 runs")
+    ap.add_argument("--cache", action="store_true", help="Store frames on the device once, then only send play requests")
+    ap.add_argument("--measure", action="store_true", help="Print bandwidth per encoding and exit")
+    ap.add_argument("--tcp", action="store_true", help="Stream over TCP, paced by the device buffer without losses")
+    ap.add_argument("--serial", help="Stream over USB CDC (or any tty) instead of the network, e.g. /dev/ttyACM0. Use with --pace, the device drops bytes it cannot buffer")
+    ap.add_argument("--pace", type=float, default=0, help="Pace to the device buffer, keeping this many ms of points queued. 0 = off")
     args = ap.parse_args()
 
     frames, palette = parse_ilda(args.file)
@@ -230,21 +495,54 @@ def main():
         print("No frames parsed or unsupported file.")
         sys.exit(1)
 
+    if args.measure:
+        measure(frames, args.scan)
+        return
+    if not args.ip and not args.serial:
+        ap.error("--ip or --serial is required")
+
     point_delay = 0.0
     if args.fps > 0:
         point_delay = 1.0 / args.fps
         
-    sender = ProjectorSender(args.ip, args.scan, point_delay=point_delay)
+    sender = ProjectorSender(args.ip, args.scan, point_delay=point_delay, pace_ms=args.pace, tcp=args.tcp, serial=args.serial)
+    start = time.monotonic()
 
     try:
+        if args.cache:
+            for i, fr in enumerate(frames):
+                sender.store_frame(i, fr.points)
+            loops = 0
+            while args.repeat == 0 or loops < args.repeat:
+                for i, fr in enumerate(frames):
+                    sender.play_frame(i, 1)
+                    # Play requests are queued on the device, stay about one frame ahead
+                    deadline = time.monotonic() + len(fr.points) / sender.scan_rate
+                    while time.monotonic() < deadline:
+                        sender._read_status(max(0.0, deadline - time.monotonic()))
+                    while sender.misses:
+                        frame_id = sender.misses.pop()
+                        sender.store_frame(frame_id, frames[frame_id].points)
+                loops += 1
+            return
+
         loops = 0
         while args.repeat == 0 or loops < args.repeat:
             for fr in frames:
-                sender.send_frame(fr.points)
+                if args.compress:
+                    sender.send_frame_compressed(fr.points)
+                else:
+                    sender.send_frame(fr.points)
             loops += 1
     except KeyboardInterrupt:
         pass
 
+    elapsed = time.monotonic() - start
+    if sender.points_sent and elapsed > 0:
+        print(f"Sent {sender.points_sent} points in {elapsed:.2f} s, {sender.points_sent / elapsed:.0f} points/s")
+    if sender.status:
+        print(f"Device: underruns {sender.status.underruns}, dropped {sender.status.dropped}")
+
 
 if __name__ == "__main__":
     main()